@@ -0,0 +1,9 @@
+n_entries=${1:-2000000}
+n_epochs=${2:-2}
+
+cd ../src
+
+g++ -O2 -std=c++17 benchmark_batchgenerator.C -o benchmark_batchgenerator $(root-config --cflags --libs) -lTMVA -lROOTDataFrame \
+  && ./benchmark_batchgenerator $n_entries $n_epochs
+
+# results printed as a table, one row per configuration
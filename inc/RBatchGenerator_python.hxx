@@ -5,6 +5,10 @@
 #include <memory>
 #include <cmath>
 #include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <string>
 
 #include "TMVA/RTensor.hxx"
 #include "ROOT/RDF/RDatasetSpec.hxx"
@@ -34,6 +38,15 @@ class RBatchGenerator {
   std::unique_ptr<RBatchLoader> fBatchLoader;
 
   std::unique_ptr<std::thread> fLoadingThread;
+
+  // number of chunks the loading thread keeps decoded ahead of the consumer
+  std::size_t fPrefetchDepth;
+
+  // epoch requested from the loading thread
+  enum class EEpochType { kNone, kTraining, kValidation };
+  EEpochType fRequestedEpoch{EEpochType::kNone};
+  bool fLoadingEpoch{false}; // Whether the loading thread is loading an epoch
+  std::condition_variable fLoadingCondition;
   
   std::size_t fChunkNum;
   std::size_t fNumEpochs;
@@ -56,17 +69,20 @@ class RBatchGenerator {
   
 
   TMVA::Experimental::RTensor<float> fTrainTensor; 
-  TMVA::Experimental::RTensor<float> fTrainChunkTensor;
 
   TMVA::Experimental::RTensor<float> fTrainBatchReminders;
   
   TMVA::Experimental::RTensor<float> fValidationTensor; 
-  TMVA::Experimental::RTensor<float> fValidationChunkTensor;
   
 
  public:
   RBatchGenerator(ROOT::RDF::RNode &rdf, const std::size_t numEpochs, const std::size_t chunkSize, const std::size_t rangeSize, const std::size_t batchSize,
-                  const float validationSplit, bool shuffle, const std::vector<std::string> &cols)
+                  const float validationSplit, bool shuffle, const std::vector<std::string> &cols,
+                  const std::size_t prefetchDepth = 2, bool clusterAware = false, const std::size_t numThreads = 1,
+                  const Long64_t seed = -1, const std::string &cachePath = "", const std::size_t worldSize = 1,
+                  const std::size_t rank = 0, const std::string &entryIndexPath = "",
+                  const std::vector<std::size_t> &vecSizes = {}, const float vecPadding = 0, bool ragged = false,
+                  const std::size_t numTargetColumns = 0, bool verbose = true)
     : f_rdf(rdf),
       fCols(cols),      
       fNumEpochs(numEpochs),
@@ -75,21 +91,27 @@ class RBatchGenerator {
       fBatchSize(batchSize),        
       fValidationSplit(validationSplit),
       fShuffle(shuffle),
+      fPrefetchDepth(std::max<std::size_t>(prefetchDepth, 1)),
       fNumColumns(cols.size()),
       fTrainTensor({0, 0}),
-      fTrainChunkTensor({0, 0}),
       fTrainBatchReminders({0, 0}),            
       fValidationTensor({0, 0}),
-      fValidationChunkTensor({0, 0}),
       fNotFiltered(f_rdf.GetFilterNames().empty())      
   
   {
 
-    fChunkLoader = std::make_unique<RChunkLoader<Args...>>(f_rdf, fChunkSize, fRangeSize, fValidationSplit, fCols, fShuffle);
-    fBatchLoader = std::make_unique<RBatchLoader>(fChunkSize, fBatchSize, fNumColumns);
+    fChunkLoader = std::make_unique<RChunkLoader<Args...>>(f_rdf, fChunkSize, fRangeSize, fValidationSplit, fCols, fShuffle, clusterAware, numThreads, seed, cachePath, worldSize, rank, entryIndexPath, vecSizes, vecPadding, ragged, numTargetColumns, fBatchSize, verbose);
+
+    // padded container columns take several floats of a row, ragged ones none
+    fNumColumns = fChunkLoader->GetRowSize();
+
+    fBatchLoader = std::make_unique<RBatchLoader>(fChunkSize, fBatchSize, fNumColumns, fPrefetchDepth,
+                                                  fChunkLoader->GetNumTargets());
     
-    fChunkLoader->PrintChunkDistributions();
-    fChunkLoader->PrintRangeDistributions();    
+    if (verbose) {
+      fChunkLoader->PrintChunkDistributions();
+      fChunkLoader->PrintRangeDistributions();
+    }
 
     fChunkLoader->CreateRangeVector();
     fChunkLoader->SortRangeVector();
@@ -97,13 +119,17 @@ class RBatchGenerator {
 
 
     fReminderBatchSize = fChunkSize % fBatchSize;
-    std::cout << "Reminder batch size: " << fReminderBatchSize << std::endl;
+    if (verbose) {
+      std::cout << "Reminder batch size: " << fReminderBatchSize << std::endl;
+    }
     
     fNumFullTrainChunks = fChunkLoader->GetNumberOfFullTrainingChunks();
     fNumFullValidationChunks = fChunkLoader->GetNumberOfFullValidationChunks();
     
     fTrainBatchReminders = fTrainBatchReminders.Resize({{fNumFullTrainChunks * fReminderBatchSize, fNumColumns}});            
-    std::cout << "Number of Training chunks " << fNumFullTrainChunks << std::endl;
+    if (verbose) {
+      std::cout << "Number of Training chunks " << fNumFullTrainChunks << std::endl;
+    }
     
     fCurrentEpoch = 0;  
 
@@ -116,13 +142,79 @@ class RBatchGenerator {
   std::size_t GetNumberOfTrainingChunks() {
     return fNumFullTrainChunks;
   }
+
+  /// \brief Number of floats in a row of a batch
+  std::size_t GetRowSize() {
+    return fNumColumns;
+  }
+
+  /// \brief Number of floats of the targets in a row of a batch. A batch holds the
+  /// features of its rows, followed by their targets
+  std::size_t GetNumTargets() {
+    return fChunkLoader->GetNumTargets();
+  }
+
+  std::size_t GetNumRaggedColumns() {
+    return fChunkLoader->GetNumRaggedColumns();
+  }
+
+  /// \brief Values of the given ragged column for the rows of the last batch,
+  /// in the order of the ragged columns among the columns
+  TMVA::Experimental::RTensor<float> GetRaggedValues(std::size_t col) {
+    return fBatchLoader->GetRaggedValues(col);
+  }
+
+  /// \brief Offsets of the rows of the last batch into the values of the given
+  /// ragged column, batchSize + 1 of them starting at 0
+  TMVA::Experimental::RTensor<Long64_t> GetRaggedOffsets(std::size_t col) {
+    return fBatchLoader->GetRaggedOffsets(col);
+  }
+
+  std::uint64_t GetSeed() {
+    return fChunkLoader->GetSeed();
+  }
+
+  /// \brief Cumulative wall-clock time in seconds spent in each stage of the loading:
+  /// reading the ranges of the chunks, creating the permutations to shuffle them,
+  /// creating the batches, the loading thread waiting for the consumer, and the
+  /// consumer waiting for batches on an empty queue.
+  std::map<std::string, double> GetStageTimings() {
+    return {{"read", fChunkLoader->GetReadTimer().GetSeconds()},
+            {"shuffle", fChunkLoader->GetShuffleTimer().GetSeconds()},
+            {"batch", fBatchLoader->GetBatchTimer().GetSeconds()},
+            {"loader_wait", fBatchLoader->GetLoaderWaitTimer().GetSeconds()},
+            {"consumer_wait", fBatchLoader->GetConsumerWaitTimer().GetSeconds()}};
+  }
+
+  /// \brief Number of chunks loaded and batches requested since the last reset
+  std::map<std::string, std::uint64_t> GetStageCounts() {
+    return {{"chunks", fChunkLoader->GetReadTimer().GetCalls()},
+            {"batch_requests", fBatchLoader->GetConsumerWaitTimer().GetCalls()}};
+  }
+
+  void ResetStageTimings() {
+    fChunkLoader->GetReadTimer().Reset();
+    fChunkLoader->GetShuffleTimer().Reset();
+    fBatchLoader->GetBatchTimer().Reset();
+    fBatchLoader->GetLoaderWaitTimer().Reset();
+    fBatchLoader->GetConsumerWaitTimer().Reset();
+  }
   
+  bool IsActive() {
+    std::lock_guard<std::mutex> lock(fIsActiveMutex);
+    return fIsActive;
+  }
+
+   /// \brief Stop the loading thread. Batches that are already queued are dropped.
    void DeActivate()
    {
       {
          std::lock_guard<std::mutex> lock(fIsActiveMutex);
          fIsActive = false;
+         fEpochActive = false;
+         fRequestedEpoch = EEpochType::kNone;
       }
+      fLoadingCondition.notify_all();
 
       fBatchLoader->DeActivate();
 
@@ -130,6 +222,7 @@ class RBatchGenerator {
          if (fLoadingThread->joinable()) {
             fLoadingThread->join();
          }
+         fLoadingThread.reset();
       }
    }
 
@@ -137,93 +230,168 @@ class RBatchGenerator {
    /// spawning the loading thread.
    void Activate()
    {
-      if (fIsActive)
-         return;
-
       {
          std::lock_guard<std::mutex> lock(fIsActiveMutex);
+         if (fIsActive)
+            return;
          fIsActive = true;
       }
 
       fBatchLoader->Activate();
-      // fLoadingThread = std::make_unique<std::thread>(&RBatchGenerator::LoadChunks, this);
-      if (fNotFiltered) {
-        std::cout << "Not filtered" << std::endl;
-        // fLoadingThread = std::make_unique<std::thread>(&RBatchGenerator::LoadChunksNoFilters, this);
-      } else {
-        std::cout << "Filtered: needs to be implemented" << std::endl;        
-        // fLoadingThread = std::make_unique<std::thread>(&RBatchGenerator::LoadChunksFilters, this);
-      }
+
+      fLoadingThread = std::make_unique<std::thread>(&RBatchGenerator::LoadChunks, this);
    }
 
+  /// \brief Start loading the training chunks of a new epoch in the background
   void ActivateEpoch() {
-    fEpochActive = true;
+    StartEpoch(EEpochType::kTraining);
+  }
+
+  /// \brief Start loading the validation chunks in the background
+  void ActivateEpochValidation() {
+    StartEpoch(EEpochType::kValidation);
   }
 
+  /// \brief End the current epoch. If the loading thread is still loading chunks
+  /// it is stopped, and the batches left in the queue are dropped.
   void DeActivateEpoch() {
+    fBatchLoader->StopLoading();
+
+    std::unique_lock<std::mutex> lock(fIsActiveMutex);
     fEpochActive = false;
+    fRequestedEpoch = EEpochType::kNone;
+    fLoadingCondition.wait(lock, [this]() { return !fLoadingEpoch; });
   }
 
-  
-  
-  TMVA::Experimental::RTensor<float> GetTrainBatch() {
-    auto batchQueue = fBatchLoader->GetNumTrainingBatchQueue();
-    // std::cout << "Batches in queue: " << batchQueue << std::endl; 
-    
-    // New epoch
-    if (fEpochActive == false) {
-      fChunkLoader->CreateTrainRangeVector();     
+  void DeActivateEpochValidation() {
+    DeActivateEpoch();
+  }
+
+  /// \brief Hand a new epoch to the loading thread. The range vectors are
+  /// reshuffled here, while the loading thread is idle.
+  void StartEpoch(EEpochType epoch) {
+    if (!IsActive()) {
+      Activate();
+    }
+
+    if (fEpochActive) {
+      DeActivateEpoch();
+    }
+
+    if (epoch == EEpochType::kTraining) {
+      fChunkLoader->CreateTrainRangeVector();
+      fBatchLoader->StartTrainingEpoch();
+    } else {
+      fChunkLoader->CreateValidationRangeVector();
+      fBatchLoader->StartValidationEpoch();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(fIsActiveMutex);
       fEpochActive = true;
-      fChunkNum = 0;
+      fRequestedEpoch = epoch;
     }
+    fLoadingCondition.notify_all();
+  }
 
-    if (batchQueue < 1 && fChunkNum < fNumFullTrainChunks) {
+  /// \brief Main loop of the loading thread. Waits for an epoch to be requested
+  /// and loads its chunks into the batch queue, which blocks when it holds
+  /// fPrefetchDepth chunks that have not been consumed yet. Errors of the epoch
+  /// are handed to the consumer, which gets them from the next batch request.
+  void LoadChunks() {
+    while (true) {
+      EEpochType epoch;
+      {
+        std::unique_lock<std::mutex> lock(fIsActiveMutex);
+        fLoadingCondition.wait(lock, [this]() { return !fIsActive || fRequestedEpoch != EEpochType::kNone; });
 
-      fChunkLoader->LoadTrainChunk(fTrainChunkTensor, fChunkNum);
-      fBatchLoader->CreateTrainingBatches(fTrainChunkTensor);
-      fBatchLoader->SaveReminderBatch(fTrainChunkTensor, fTrainBatchReminders, fChunkNum);
-      
-      // std::cout << " " << std::endl;      
-      // std::cout << "Loaded chunk: " << fChunkNum + 1 << std::endl;
-      // std::cout << fTrainChunkTensor << std::endl;
-      // std::cout << " " << std::endl;
+        if (!fIsActive)
+          return;
 
-      // std::cout << "Saved reminder batch from chunk: " << std::endl;
-      // std::cout << fTrainBatchReminders << std::endl;
-      // std::cout << " " << std::endl;      
-      // std::cout << "Reminder batch: " << *batch << std::endl;      
+        epoch = fRequestedEpoch;
+        fRequestedEpoch = EEpochType::kNone;
+        fLoadingEpoch = true;
+      }
+
+      // an error ends the epoch, and is rethrown to the consumer by the batch loader
+      try {
+        if (epoch == EEpochType::kTraining) {
+          LoadTrainChunks();
+        } else {
+          LoadValidationChunks();
+        }
+      } catch (...) {
+        fBatchLoader->SetLoadingException(std::current_exception());
+      }
 
-      
-      fChunkNum++;
+      {
+        std::lock_guard<std::mutex> lock(fIsActiveMutex);
+        fLoadingEpoch = false;
+      }
+      fLoadingCondition.notify_all();
     }
+  }
 
-    // Get next batch if available
-    return fBatchLoader->GetTrainBatch();
+  void LoadTrainChunks() {
+    for (std::size_t chunk = 0; chunk < fNumFullTrainChunks && fBatchLoader->IsLoading(); chunk++) {
+      // the chunk is loaded into a buffer of the pool, and the batches are views into it
+      RChunkView chunkView = fBatchLoader->AcquireChunk();
+      if (!chunkView.fBuffer)
+        break;
+
+      fChunkLoader->LoadTrainChunk(chunkView.fTensor, chunk, &chunkView.fBuffer->fRagged);
+      fBatchLoader->CreateTrainingBatches(chunkView);
+      fBatchLoader->SaveReminderBatch(chunkView.fTensor, fTrainBatchReminders, chunk);
+    }
+
+    fBatchLoader->FinishTrainingLoading();
+
+    // stopped by DeActivateEpoch, so that the next epoch never waits for the cache
+    fChunkLoader->CompleteCache([this]() { return fBatchLoader->IsLoading(); });
   }
 
-  TMVA::Experimental::RTensor<float> GetValidationBatch() {
-    auto batchQueue = fBatchLoader->GetNumValidationBatchQueue();
-    
+  void LoadValidationChunks() {
+    for (std::size_t chunk = 0; chunk < fNumFullValidationChunks && fBatchLoader->IsLoading(); chunk++) {
+      RChunkView chunkView = fBatchLoader->AcquireChunk();
+      if (!chunkView.fBuffer)
+        break;
+
+      fChunkLoader->LoadValidationChunk(chunkView.fTensor, chunk, &chunkView.fBuffer->fRagged);
+      fBatchLoader->CreateValidationBatches(chunkView);
+    }
+
+    fBatchLoader->FinishValidationLoading();
+
+    fChunkLoader->CompleteCache([this]() { return fBatchLoader->IsLoading(); });
+  }
+
+  /// \brief Returns the next batch of training data. Starts a new epoch if none
+  /// is active, and blocks until the loading thread has queued a batch.
+  /// Returns a batch with an empty tensor once all training batches of the epoch
+  /// are consumed, and rethrows the errors raised while loading the chunks.
+  /// The batch is a view into a pooled chunk buffer, which is not reused while
+  /// the batch is kept.
+  RChunkView GetTrainBatch() {
     // New epoch
     if (fEpochActive == false) {
-      fChunkLoader->CreateValidationRangeVector();     
-      fEpochActive = true;
-      fChunkNum = 0;
+      StartEpoch(EEpochType::kTraining);
     }
 
-    if (batchQueue < 1 && fChunkNum < fNumFullValidationChunks) {
+    return fBatchLoader->GetTrainBatch();
+  }
 
-      fChunkLoader->LoadValidationChunk(fValidationChunkTensor, fChunkNum);
-      fBatchLoader->CreateValidationBatches(fValidationChunkTensor);
-      
-      fChunkNum++;
+  /// \brief Returns the next batch of validation data. Starts a new epoch if none
+  /// is active, and blocks until the loading thread has queued a batch.
+  /// Returns a batch with an empty tensor once all validation batches
+  /// are consumed, and rethrows the errors raised while loading the chunks.
+  /// The batch is a view into a pooled chunk buffer, which is not reused while
+  /// the batch is kept.
+  RChunkView GetValidationBatch() {
+    // New epoch
+    if (fEpochActive == false) {
+      StartEpoch(EEpochType::kValidation);
     }
-    // Get next batch if available
+
     return fBatchLoader->GetValidationBatch();
   }
-  
-  
-
-  /// \brief Returns the next batch of validation data if available.
-  /// Returns empty RTensor otherwise.
 };
@@ -1,8 +1,12 @@
 #include "TMVA/RTensor.hxx"
 #include "ROOT/RDF/RDatasetSpec.hxx"
 #include "TROOT.h"
+#include "RStageTimer.hxx"
+#include "RColumnLayout.hxx"
 
+#include <algorithm>
 #include <cmath>
+#include <exception>
 #include <memory>
 #include <mutex>
 #include <random>
@@ -15,15 +19,57 @@
 
 
 // Imports for threading
-// #include <queue>
-// #include <mutex>
-// #include <condition_variable>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+
+/// \brief The rows of a chunk, and the values of its ragged columns
+struct RChunkBuffer {
+  std::vector<float> fData;
+  RRaggedColumns fRagged;
+};
+
+/// \brief Chunk buffers that are not referenced by any batch. The buffers hold the
+/// pool through a weak reference, so that a batch may outlive its RBatchLoader.
+struct RChunkBufferPool {
+  std::mutex fLock;
+  std::vector<std::unique_ptr<RChunkBuffer>> fFreeBuffers;
+  // buffers beyond this number are freed instead of kept for later chunks
+  std::size_t fMaxFreeBuffers = 0;
+
+  /// \brief Return a buffer to the pool once no batch refers to it anymore, or free
+  /// it if the pool is full or gone
+  static void Release(const std::weak_ptr<RChunkBufferPool> &weakPool, RChunkBuffer *buffer)
+  {
+    std::unique_ptr<RChunkBuffer> owned(buffer);
+    if (auto pool = weakPool.lock()) {
+      std::lock_guard<std::mutex> lock(pool->fLock);
+      if (pool->fFreeBuffers.size() < pool->fMaxFreeBuffers) {
+        pool->fFreeBuffers.push_back(std::move(owned));
+      }
+    }
+  }
+};
+
+/// \brief A tensor that is a view into a chunk buffer of the RBatchLoader.
+/// The buffer is returned to the pool of the RBatchLoader when the last view on it
+/// is destroyed, so a batch stays valid as long as it is kept. fBatch is the index
+/// of a batch in its chunk.
+struct RChunkView {
+  std::shared_ptr<RChunkBuffer> fBuffer;
+  TMVA::Experimental::RTensor<float> fTensor{std::vector<std::size_t>({0})};
+  std::size_t fBatch = 0;
+};
 
 class RBatchLoader {
  private:
   std::size_t fBatchSize;
   std::size_t fChunkSize;  
   std::size_t fNumColumns;
+  // floats of the targets in a row, stored after the features of every batch
+  std::size_t fNumTargets;
+  // rows of a chunk buffer, the reminder rows take a full batch
+  std::size_t fNumChunkRows;
   std::size_t fMaxBatches;
   std::size_t fTrainingRemainderRow = 0;
   std::size_t fValidationRemainderRow = 0;
@@ -34,26 +80,47 @@ class RBatchLoader {
   
   bool fIsActive = false;
 
+  // set by the loading thread once all chunks of the current epoch are queued
+  bool fTrainingLoadingDone = true;
+  bool fValidationLoadingDone = true;
+
+  // set when an epoch is stopped before the loading thread has finished it
+  bool fStopLoading = false;
+
+  // error of the loading thread, rethrown to the consumer once the queued batches are consumed
+  std::exception_ptr fLoadingException;
+
   std::mutex fBatchLock;
   std::condition_variable fBatchCondition;
 
-  std::queue<std::unique_ptr<TMVA::Experimental::RTensor<float>>> fTrainingBatchQueue;
-  std::queue<std::unique_ptr<TMVA::Experimental::RTensor<float>>> fValidationBatchQueue;
+  // chunk buffers that are not referenced by any batch
+  std::shared_ptr<RChunkBufferPool> fChunkBufferPool = std::make_shared<RChunkBufferPool>();
+
+  // the batches are views into the chunk buffers, and keep them alive
+  std::queue<RChunkView> fTrainingBatchQueue;
+  std::queue<RChunkView> fValidationBatchQueue;
 
   std::size_t fNumTrainingBatchQueue;
   std::size_t fNumValidationBatchQueue;
   
-  std::unique_ptr<TMVA::Experimental::RTensor<float>> fCurrentBatch;
+  RChunkView fCurrentBatch;
+
+  // time spent creating batches, time the loading thread waits for space in the
+  // queue, and time the consumer waits for a batch
+  RStageTimer fBatchTimer;
+  RStageTimer fLoaderWaitTimer;
+  RStageTimer fConsumerWaitTimer;
 
   std::unique_ptr<TMVA::Experimental::RTensor<float>> fTrainingRemainder;
   std::unique_ptr<TMVA::Experimental::RTensor<float>> fValidationRemainder;
 
  public:
   RBatchLoader( std::size_t chunkSize, std::size_t batchSize,
-                std::size_t numColumns)
+                std::size_t numColumns, std::size_t prefetchDepth = 1, std::size_t numTargets = 0)
     : fChunkSize(chunkSize),
       fBatchSize(batchSize),
-      fNumColumns(numColumns)
+      fNumColumns(numColumns),
+      fNumTargets(numTargets)
         
   {
     fNumTrainingBatchQueue = fTrainingBatchQueue.size();
@@ -61,6 +128,21 @@ class RBatchLoader {
     
     fNumChunkBatches = fChunkSize / fBatchSize;
     fChunkReminderBatchSize = fChunkSize % fBatchSize;
+    fNumChunkRows = (fNumChunkBatches + (fChunkReminderBatchSize == 0 ? 0 : 1)) * fBatchSize;
+
+    // the queues hold at most prefetchDepth chunks worth of batches
+    fMaxBatches = std::max<std::size_t>(prefetchDepth, 1) * fNumChunkBatches;
+
+    // the queued chunks, the chunk of the current batch and the chunk being loaded
+    fChunkBufferPool->fMaxFreeBuffers = std::max<std::size_t>(prefetchDepth, 1) + 2;
+  }
+
+  ~RBatchLoader()
+  {
+    // release the views while the pool they return their buffers to still exists
+    fTrainingBatchQueue = {};
+    fValidationBatchQueue = {};
+    fCurrentBatch = {};
   }
 
  public:
@@ -77,97 +159,284 @@ class RBatchLoader {
     fBatchCondition.notify_all();
   }
 
-  /// \brief DeActivate the batchloader. This means that no more batches are created.
-  /// Batches can still be returned if they are already loaded
+  /// \brief DeActivate the batchloader. No more batches are created, and the batches
+  /// that are still queued are dropped.
   void DeActivate()
   {
+    std::queue<RChunkView> droppedTrainingBatches;
+    std::queue<RChunkView> droppedValidationBatches;
     {
       std::lock_guard<std::mutex> lock(fBatchLock);
       fIsActive = false;
+      std::swap(droppedTrainingBatches, fTrainingBatchQueue);
+      std::swap(droppedValidationBatches, fValidationBatchQueue);
     }
     fBatchCondition.notify_all();
   }
 
 
-  TMVA::Experimental::RTensor<float> GetTrainBatch()
+  /// \brief Return the next training batch. Blocks until the loading thread has
+  /// queued a batch, and returns a batch with an empty tensor once the epoch is exhausted.
+  RChunkView GetTrainBatch()
+  {
+    return GetBatch(fTrainingBatchQueue, fTrainingLoadingDone);
+  }
+
+  /// \brief Return the next validation batch. Blocks until the loading thread has
+  /// queued a batch, and returns a batch with an empty tensor once the epoch is exhausted.
+  RChunkView GetValidationBatch()
   {
+    return GetBatch(fValidationBatchQueue, fValidationLoadingDone);
+  }
 
-    if (fTrainingBatchQueue.empty()) {
-      fCurrentBatch = std::make_unique<TMVA::Experimental::RTensor<float>>(std::vector<std::size_t>({0}));
-      return *fCurrentBatch;
+  /// \brief Return the next batch of the queue as a view into its chunk buffer.
+  /// The buffer is not reused while the returned batch, or the current batch of the
+  /// RBatchLoader, refers to it.
+  /// Rethrows the error of the loading thread once the queued batches are consumed.
+  RChunkView GetBatch(std::queue<RChunkView> &batchQueue, const bool &loadingDone)
+  {
+    // the previous batch may hold the last reference to its chunk buffer,
+    // which has to be released without holding the lock
+    RChunkView previousBatch;
+    {
+      std::unique_lock<std::mutex> lock(fBatchLock);
+      {
+        RStageTimer::RScope scope(fConsumerWaitTimer);
+        fBatchCondition.wait(lock, [&]() { return !batchQueue.empty() || loadingDone || !fIsActive; });
+      }
+
+      previousBatch = std::move(fCurrentBatch);
+
+      if (batchQueue.empty() && fLoadingException) {
+        fCurrentBatch = RChunkView();
+        std::exception_ptr exception;
+        std::swap(exception, fLoadingException);
+        lock.unlock();
+        std::rethrow_exception(exception);
+      }
+
+      if (batchQueue.empty()) {
+        fCurrentBatch = RChunkView();
+        return fCurrentBatch;
+      }
+
+      fCurrentBatch = std::move(batchQueue.front());
+      batchQueue.pop();
+    }
+
+    // wake up the loading thread if it is waiting for space in the queue
+    fBatchCondition.notify_all();
+    return fCurrentBatch;
+  }
+
+  /// \brief Take a chunk buffer from the pool, as a tensor of numColumns floats for
+  /// the chunkSize rows rounded up to a multiple of the batch size. A new buffer is
+  /// allocated if all of them are still referenced by batches.
+  /// Returns a view without buffer if the epoch is stopped.
+  RChunkView AcquireChunk()
+  {
+    {
+      std::lock_guard<std::mutex> lock(fBatchLock);
+      if (!fIsActive || fStopLoading) {
+        return RChunkView();
+      }
+    }
+
+    std::unique_ptr<RChunkBuffer> buffer;
+    {
+      std::lock_guard<std::mutex> lock(fChunkBufferPool->fLock);
+      if (!fChunkBufferPool->fFreeBuffers.empty()) {
+        buffer = std::move(fChunkBufferPool->fFreeBuffers.back());
+        fChunkBufferPool->fFreeBuffers.pop_back();
+      }
     }
 
-    fCurrentBatch = std::move(fTrainingBatchQueue.front());
-    fTrainingBatchQueue.pop();
+    if (!buffer) {
+      buffer = std::make_unique<RChunkBuffer>();
+      buffer->fData.resize(fNumChunkRows * fNumColumns);
+      buffer->fRagged.fBatchSize = fBatchSize;
+    }
+
+    RChunkView chunk;
+    chunk.fTensor = TMVA::Experimental::RTensor<float>(buffer->fData.data(), {fNumChunkRows, fNumColumns});
+    chunk.fBuffer = std::shared_ptr<RChunkBuffer>(
+      buffer.release(), [pool = std::weak_ptr<RChunkBufferPool>(fChunkBufferPool)](RChunkBuffer *b) {
+        RChunkBufferPool::Release(pool, b);
+      });
+    return chunk;
+  }
 
-    // std::cout << *fCurrentBatch << std::endl;
-    return *fCurrentBatch;
+  /// \brief Prepare the training queue for a new epoch
+  void StartTrainingEpoch()
+  {
+    std::queue<RChunkView> droppedBatches;
+    std::lock_guard<std::mutex> lock(fBatchLock);
+    std::swap(droppedBatches, fTrainingBatchQueue);
+    fTrainingLoadingDone = false;
+    fStopLoading = false;
   }
 
-  TMVA::Experimental::RTensor<float> GetValidationBatch()
+  /// \brief Prepare the validation queue for a new epoch
+  void StartValidationEpoch()
   {
+    std::queue<RChunkView> droppedBatches;
+    std::lock_guard<std::mutex> lock(fBatchLock);
+    std::swap(droppedBatches, fValidationBatchQueue);
+    fValidationLoadingDone = false;
+    fStopLoading = false;
+  }
 
-    if (fValidationBatchQueue.empty()) {
-      fCurrentBatch = std::make_unique<TMVA::Experimental::RTensor<float>>(std::vector<std::size_t>({0}));
-      return *fCurrentBatch;
+  /// \brief Signal that all training chunks of the epoch have been queued
+  void FinishTrainingLoading()
+  {
+    {
+      std::lock_guard<std::mutex> lock(fBatchLock);
+      fTrainingLoadingDone = true;
     }
-    fCurrentBatch = std::move(fValidationBatchQueue.front());
-    fValidationBatchQueue.pop();
+    fBatchCondition.notify_all();
+  }
 
-    // std::cout << *fCurrentBatch << std::endl;
-    return *fCurrentBatch;
+  /// \brief Signal that all validation chunks of the epoch have been queued
+  void FinishValidationLoading()
+  {
+    {
+      std::lock_guard<std::mutex> lock(fBatchLock);
+      fValidationLoadingDone = true;
+    }
+    fBatchCondition.notify_all();
+  }
+
+  /// \brief Store an error of the loading thread, and end the loading of the current
+  /// epoch. The error is rethrown by the next batch request that finds the queue empty.
+  void SetLoadingException(std::exception_ptr exception)
+  {
+    {
+      std::lock_guard<std::mutex> lock(fBatchLock);
+      fLoadingException = exception;
+      fTrainingLoadingDone = true;
+      fValidationLoadingDone = true;
+    }
+    fBatchCondition.notify_all();
   }
-  
-  /// \brief Return a batch of data as a unique pointer.
-  /// After the batch has been processed, it should be destroyed.
-  /// \return Training batch
-  std::unique_ptr<TMVA::Experimental::RTensor<float>>
-  CreateBatch(TMVA::Experimental::RTensor<float> &chunkTensor, std::size_t idxs) {
-    auto batch = std::make_unique<TMVA::Experimental::RTensor<float>>(std::vector<std::size_t>({fBatchSize, fNumColumns}));
-    std::copy(chunkTensor.GetData() + (idxs * fBatchSize * fNumColumns),
-              chunkTensor.GetData() + ((idxs + 1) * fBatchSize * fNumColumns), batch->GetData());
 
+  /// \brief Stop the current epoch. The loading thread stops queueing batches and
+  /// the batches that are still queued are dropped.
+  void StopLoading()
+  {
+    std::queue<RChunkView> droppedTrainingBatches;
+    std::queue<RChunkView> droppedValidationBatches;
+    {
+      std::lock_guard<std::mutex> lock(fBatchLock);
+      fStopLoading = true;
+      fTrainingLoadingDone = true;
+      fValidationLoadingDone = true;
+      std::swap(droppedTrainingBatches, fTrainingBatchQueue);
+      std::swap(droppedValidationBatches, fValidationBatchQueue);
+    }
+    fBatchCondition.notify_all();
+  }
+
+  /// \brief Whether the loading thread should keep loading chunks for the current epoch
+  bool IsLoading()
+  {
+    std::lock_guard<std::mutex> lock(fBatchLock);
+    return fIsActive && !fStopLoading;
+  }
+
+  /// \brief Return a batch of data as a view into the chunk buffer: the features of
+  /// the batchSize rows, followed by their targets.
+  /// The batch keeps the chunk buffer alive until it is destroyed.
+  /// \return Training batch
+  RChunkView CreateBatch(const RChunkView &chunk, std::size_t idxs) {
+    RChunkView batch;
+    batch.fBuffer = chunk.fBuffer;
+    batch.fTensor = TMVA::Experimental::RTensor<float>(chunk.fBuffer->fData.data() + (idxs * fBatchSize * fNumColumns),
+                                                       {fBatchSize, fNumColumns});
+    batch.fBatch = idxs;
     return batch;
   }
 
+  /// \brief Values of the given ragged column for the rows of the current batch, as
+  /// a view into its chunk buffer. Valid as long as the current batch, or a copy of
+  /// it, is kept.
+  TMVA::Experimental::RTensor<float> GetRaggedValues(std::size_t col)
+  {
+    if (!fCurrentBatch.fBuffer) {
+      return TMVA::Experimental::RTensor<float>(std::vector<std::size_t>({0}));
+    }
+
+    auto &ragged = fCurrentBatch.fBuffer->fRagged;
+    const auto &batchBegins = ragged.fBatchBegins[col];
+    const std::size_t begin = batchBegins[fCurrentBatch.fBatch];
+    const std::size_t end = batchBegins[fCurrentBatch.fBatch + 1];
+    return TMVA::Experimental::RTensor<float>(ragged.fValues[col].data() + begin, {end - begin});
+  }
+
+  /// \brief batchSize + 1 offsets of the rows of the current batch into the values
+  /// of the given ragged column, starting at 0. Valid as long as the current batch,
+  /// or a copy of it, is kept.
+  TMVA::Experimental::RTensor<Long64_t> GetRaggedOffsets(std::size_t col)
+  {
+    if (!fCurrentBatch.fBuffer) {
+      return TMVA::Experimental::RTensor<Long64_t>(std::vector<std::size_t>({0}));
+    }
+
+    auto &ragged = fCurrentBatch.fBuffer->fRagged;
+    return TMVA::Experimental::RTensor<Long64_t>(ragged.fOffsets[col].data() + fCurrentBatch.fBatch * (fBatchSize + 1),
+                                                 {fBatchSize + 1});
+  }
+
 
+  /// \brief Copy the reminder rows of a chunk, the features of the rows followed by
+  /// their targets, to the given reminder batch
   void SaveReminderBatch(TMVA::Experimental::RTensor<float> &chunkTensor, TMVA::Experimental::RTensor<float> &reminderBatchesTensor, std::size_t idxs)
   {
-    std::copy(chunkTensor.GetData() + (fNumChunkBatches * fBatchSize * fNumColumns),
-              chunkTensor.GetData() + (fNumChunkBatches *  fBatchSize * fNumColumns + fChunkReminderBatchSize * fNumColumns),
-              reminderBatchesTensor.GetData() + (idxs * fChunkReminderBatchSize * fNumColumns));
+    const std::size_t numFeatures = fNumColumns - fNumTargets;
+    const float *block = chunkTensor.GetData() + fNumChunkBatches * fBatchSize * fNumColumns;
+    float *reminder = reminderBatchesTensor.GetData() + idxs * fChunkReminderBatchSize * fNumColumns;
+
+    std::copy(block, block + fChunkReminderBatchSize * numFeatures, reminder);
+    std::copy(block + fBatchSize * numFeatures, block + fBatchSize * numFeatures + fChunkReminderBatchSize * fNumTargets,
+              reminder + fChunkReminderBatchSize * numFeatures);
   }
   
-  void CreateTrainingBatches(TMVA::Experimental::RTensor<float> &chunkTensor)
+  void CreateTrainingBatches(const RChunkView &chunk)
   {
-
-    std::vector<std::unique_ptr<TMVA::Experimental::RTensor<float>>> batches;
-      
-    for (std::size_t i = 0; i < fNumChunkBatches; i++) {
-      // Fill a batch
-      batches.emplace_back(CreateBatch(chunkTensor, i));
-    }
-      
-    for (std::size_t i = 0; i < batches.size(); i++) {
-      fTrainingBatchQueue.push(std::move(batches[i]));
-    }
-      
+    PushBatches(chunk, fTrainingBatchQueue);
   }
 
-  void CreateValidationBatches(TMVA::Experimental::RTensor<float> &chunkTensor)
+  void CreateValidationBatches(const RChunkView &chunk)
   {
+    PushBatches(chunk, fValidationBatchQueue);
+  }
 
-    std::vector<std::unique_ptr<TMVA::Experimental::RTensor<float>>> batches;
-      
+  /// \brief Split a chunk into batches and push them to the given queue.
+  /// Blocks while the queue is full, and returns early when the epoch is stopped.
+  void PushBatches(const RChunkView &chunk, std::queue<RChunkView> &batchQueue)
+  {
     for (std::size_t i = 0; i < fNumChunkBatches; i++) {
       // Fill a batch
-      batches.emplace_back(CreateBatch(chunkTensor, i));
-    }
-      
-    for (std::size_t i = 0; i < batches.size(); i++) {
-      fValidationBatchQueue.push(std::move(batches[i]));
+      RChunkView batch;
+      {
+        RStageTimer::RScope scope(fBatchTimer);
+        batch = CreateBatch(chunk, i);
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(fBatchLock);
+        {
+          RStageTimer::RScope scope(fLoaderWaitTimer);
+          fBatchCondition.wait(lock, [&]() { return batchQueue.size() < fMaxBatches || !fIsActive || fStopLoading; });
+        }
+
+        if (!fIsActive || fStopLoading) {
+          return;
+        }
+
+        batchQueue.push(std::move(batch));
+      }
+      fBatchCondition.notify_all();
     }
-      
   }
   
   // void CopyReminderBatch()
@@ -176,11 +445,25 @@ class RBatchLoader {
   //   return fTrainingBatchQueue;
   // }
   
+  RStageTimer &GetBatchTimer() {
+    return fBatchTimer;
+  }
+
+  RStageTimer &GetLoaderWaitTimer() {
+    return fLoaderWaitTimer;
+  }
+
+  RStageTimer &GetConsumerWaitTimer() {
+    return fConsumerWaitTimer;
+  }
+
   std::size_t GetNumTrainingBatchQueue() {
+    std::lock_guard<std::mutex> lock(fBatchLock);
     return fTrainingBatchQueue.size();
   }
 
   std::size_t GetNumValidationBatchQueue() {
+    std::lock_guard<std::mutex> lock(fBatchLock);
     return fValidationBatchQueue.size();
   }
   
@@ -0,0 +1,234 @@
+#ifndef RCHUNKCACHE_HXX
+#define RCHUNKCACHE_HXX
+
+#include "TROOT.h"
+#include "RColumnLayout.hxx"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/// \brief On-disk cache of the decoded dataset, as a flat float row-major file
+/// with one row per entry. The rows of a range [begin, end) are the rows
+/// [begin, end) of the file.
+///
+/// The cache is filled while the chunks of the first epoch are loaded, in a
+/// temporary file that is renamed once every entry has been written. Later
+/// epochs, and later runs, memory-map it and copy the ranges straight from the
+/// page cache. The file starts with a key describing the source files, the
+/// columns and their types, and is rebuilt if the key does not match.
+class RChunkCache {
+ private:
+  struct RHeader {
+    char fMagic[8];
+    std::uint64_t fNumEntries;
+    std::uint64_t fNumColumns;
+    std::uint64_t fKeySize;
+    std::uint64_t fComplete;
+  };
+
+  static constexpr const char *kMagic = "RBGCACHE";
+  static constexpr std::size_t kPageSize = 4096;
+
+  std::string fPath;
+  std::string fTmpPath;
+  std::string fKey;
+  std::size_t fNumEntries;
+  std::size_t fNumColumns;
+
+  int fFile = -1;
+  float *fData = nullptr;
+  std::size_t fDataOffset;
+  std::size_t fMappedSize = 0;
+
+  bool fComplete = false;
+
+  // entries that are already written to the cache while it is being filled
+  std::vector<bool> fCachedEntries;
+  std::size_t fNumCachedEntries = 0;
+
+  bool OpenExisting()
+  {
+    int file = open(fPath.c_str(), O_RDONLY);
+    if (file < 0)
+      return false;
+
+    // a truncated file would raise SIGBUS when its missing pages are read
+    struct stat fileStat;
+    RHeader header;
+    std::string key(fKey.size(), '\0');
+    bool valid = fstat(file, &fileStat) == 0 && static_cast<std::size_t>(fileStat.st_size) >= fMappedSize &&
+                 pread(file, &header, sizeof(header), 0) == sizeof(header) &&
+                 std::strncmp(header.fMagic, kMagic, sizeof(header.fMagic)) == 0 &&
+                 header.fNumEntries == fNumEntries && header.fNumColumns == fNumColumns &&
+                 header.fKeySize == fKey.size() && header.fComplete == 1 &&
+                 pread(file, &key[0], key.size(), sizeof(header)) == static_cast<ssize_t>(key.size()) &&
+                 key == fKey;
+
+    if (!valid) {
+      close(file);
+      return false;
+    }
+
+    void *mapped = mmap(nullptr, fMappedSize, PROT_READ, MAP_SHARED, file, 0);
+    if (mapped == MAP_FAILED) {
+      close(file);
+      return false;
+    }
+
+    fFile = file;
+    fData = reinterpret_cast<float *>(static_cast<char *>(mapped) + fDataOffset);
+    fComplete = true;
+    return true;
+  }
+
+  bool CreateTemporary()
+  {
+    fTmpPath = fPath + ".tmp." + std::to_string(getpid());
+
+    int file = open(fTmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+      return false;
+
+    RHeader header;
+    std::memcpy(header.fMagic, kMagic, sizeof(header.fMagic));
+    header.fNumEntries = fNumEntries;
+    header.fNumColumns = fNumColumns;
+    header.fKeySize = fKey.size();
+    header.fComplete = 0;
+
+    // the blocks are allocated up front, since writing to a page of a sparse file
+    // on a full disk raises SIGBUS
+    void *mapped = MAP_FAILED;
+    if (posix_fallocate(file, 0, fMappedSize) == 0 && pwrite(file, &header, sizeof(header), 0) == sizeof(header) &&
+        pwrite(file, fKey.data(), fKey.size(), sizeof(header)) == static_cast<ssize_t>(fKey.size())) {
+      mapped = mmap(nullptr, fMappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+
+    if (mapped == MAP_FAILED) {
+      close(file);
+      unlink(fTmpPath.c_str());
+      return false;
+    }
+
+    fFile = file;
+    fData = reinterpret_cast<float *>(static_cast<char *>(mapped) + fDataOffset);
+    fCachedEntries.assign(fNumEntries, false);
+    return true;
+  }
+
+ public:
+  RChunkCache(const std::string &path, const std::string &key, std::size_t numEntries, std::size_t numColumns)
+    : fPath(path),
+      fKey(key),
+      fNumEntries(numEntries),
+      fNumColumns(numColumns)
+  {
+    fDataOffset = (sizeof(RHeader) + fKey.size() + kPageSize - 1) / kPageSize * kPageSize;
+    fMappedSize = fDataOffset + fNumEntries * fNumColumns * sizeof(float);
+
+    if (OpenExisting()) {
+      std::cout << "Using chunk cache " << fPath << std::endl;
+    } else if (CreateTemporary()) {
+      std::cout << "Creating chunk cache " << fPath << std::endl;
+    } else {
+      std::cout << "Chunk cache " << fPath << " could not be created, reading from the dataset" << std::endl;
+    }
+  }
+
+  ~RChunkCache()
+  {
+    if (fData) {
+      munmap(reinterpret_cast<char *>(fData) - fDataOffset, fMappedSize);
+    }
+
+    if (fFile >= 0) {
+      close(fFile);
+    }
+
+    // an incomplete cache can not be reused. A complete one has been renamed already
+    if (!fTmpPath.empty()) {
+      unlink(fTmpPath.c_str());
+    }
+  }
+
+  /// \brief Whether the cache could be opened or created
+  bool IsOpen() const { return fData != nullptr; }
+
+  /// \brief Whether every entry is in the cache
+  bool IsComplete() const { return fComplete; }
+
+  /// \brief Whether the range starting at the given entry is in the cache.
+  /// Ranges are always written as a whole.
+  bool IsCached(Long64_t begin) const { return fComplete || (IsOpen() && fCachedEntries[begin]); }
+
+  /// \brief Copy the range [begin, end) to the rows starting at row of data, laid out
+  /// with the given layout, or to the rows rowPermutation[row], rowPermutation[row + 1],
+  /// ... if a permutation is given
+  void ReadRange(Long64_t begin, Long64_t end, float *data, std::size_t row, const std::size_t *rowPermutation,
+                 const RColumnLayout &layout)
+  {
+    for (Long64_t entry = begin; entry < end; entry++, row++) {
+      std::size_t dataRow = rowPermutation ? rowPermutation[row] : row;
+      const float *cached = fData + entry * fNumColumns;
+      std::memcpy(layout.GetFeatures(data, dataRow), cached, layout.fNumFeatures * sizeof(float));
+      std::memcpy(layout.GetTargets(data, dataRow), cached + layout.fNumFeatures, layout.fNumTargets * sizeof(float));
+    }
+  }
+
+  /// \brief Copy the rows that hold the range [begin, end) in data to the cache,
+  /// the inverse of ReadRange
+  void WriteRange(Long64_t begin, Long64_t end, float *data, std::size_t row, const std::size_t *rowPermutation,
+                  const RColumnLayout &layout)
+  {
+    for (Long64_t entry = begin; entry < end; entry++, row++) {
+      std::size_t dataRow = rowPermutation ? rowPermutation[row] : row;
+      float *cached = fData + entry * fNumColumns;
+      std::memcpy(cached, layout.GetFeatures(data, dataRow), layout.fNumFeatures * sizeof(float));
+      std::memcpy(cached + layout.fNumFeatures, layout.GetTargets(data, dataRow), layout.fNumTargets * sizeof(float));
+    }
+
+    MarkCached(begin, end);
+  }
+
+  /// \brief Mark the range [begin, end) as written. Once every entry is written,
+  /// the cache is made available to later runs.
+  void MarkCached(Long64_t begin, Long64_t end)
+  {
+    for (Long64_t entry = begin; entry < end; entry++) {
+      if (!fCachedEntries[entry]) {
+        fCachedEntries[entry] = true;
+        fNumCachedEntries++;
+      }
+    }
+
+    if (fNumCachedEntries == fNumEntries) {
+      Finish();
+    }
+  }
+
+  void Finish()
+  {
+    const std::uint64_t complete = 1;
+    msync(reinterpret_cast<char *>(fData) - fDataOffset, fMappedSize, MS_SYNC);
+
+    if (pwrite(fFile, &complete, sizeof(complete), offsetof(RHeader, fComplete)) == sizeof(complete) &&
+        std::rename(fTmpPath.c_str(), fPath.c_str()) == 0) {
+      std::cout << "Chunk cache " << fPath << " complete" << std::endl;
+    }
+
+    fComplete = true;
+    fCachedEntries = {};
+  }
+};
+
+#endif // RCHUNKCACHE_HXX
@@ -1,8 +1,19 @@
 #include "TMVA/RTensor.hxx"
 #include "ROOT/RDF/RDatasetSpec.hxx"
 #include "TROOT.h"
-
+#include "RRangeReader.hxx"
+#include "RStageTimer.hxx"
+#include "RChunkCache.hxx"
+#include "REntryIndex.hxx"
+#include "RColumnLayout.hxx"
+#include "TSystem.h"
+
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iomanip>
 #include <memory>
 #include <mutex>
 #include <random>
@@ -11,33 +22,44 @@
 #include <vector>
 #include <iostream>
 #include <list>
+#include <numeric>
 #include <set>
+#include <stdexcept>
+#include <string>
 
 template <typename... ColTypes>
 class RRangeChunkLoaderFunctor {
-  std::size_t fOffset{};  
-  std::size_t fVecSizeIdx{};
   TMVA::Experimental::RTensor<float> &fChunkTensor;
-  int fI;
-  int fNumColumns;
-  template <typename T, std::enable_if_t<!ROOT::Internal::RDF::IsDataContainer<T>::value, int> = 0>
-  void AssignToTensorRange(const T &val, int i, int numColumns)
+  const RColumnLayout &fLayout;
+  const std::size_t *fRowPermutation;
+  RRaggedStaging *fStaging;
+  std::size_t fRow;
+
+  template <std::size_t... I>
+  void AssignToRow(std::size_t row, std::index_sequence<I...>, const ColTypes &...cols)
   {
-    fChunkTensor.GetData()[fOffset++ + numColumns*i] = val;
+    (fLayout.template Write<ColTypes>(I, cols, fChunkTensor.GetData(), row, fStaging, 0), ...);
   }
   
  public:
-  RRangeChunkLoaderFunctor(TMVA::Experimental::RTensor<float> &chunkTensor, int i, int numColumns)
+  /// \brief Writes the entries of a range to the rows starting at row, or to the
+  /// rows rowPermutation[row], rowPermutation[row + 1], ... if a permutation is given
+  RRangeChunkLoaderFunctor(TMVA::Experimental::RTensor<float> &chunkTensor, std::size_t row,
+                           const RColumnLayout &layout, const std::size_t *rowPermutation = nullptr,
+                           RRaggedStaging *staging = nullptr)
     : fChunkTensor(chunkTensor),
-      fI(i),
-      fNumColumns(numColumns)
+      fLayout(layout),
+      fRowPermutation(rowPermutation),
+      fStaging(staging),
+      fRow(row)
   {
   }
 
   void operator()( const ColTypes &...cols)
   {
-    fVecSizeIdx = 1;
-    (AssignToTensorRange(cols, fI, fNumColumns), ...);
+    std::size_t row = fRowPermutation ? fRowPermutation[fRow] : fRow;
+    fRow++;
+    AssignToRow(row, std::index_sequence_for<ColTypes...>{}, cols...);
   }
   
 };
@@ -124,27 +146,151 @@ class RChunkLoader {
   ROOT::RDF::RNode &f_rdf;
   // ROOT::RDataFrame &f_rdf;
   std::vector<std::string> fCols;
+  // number of floats in a row of a chunk
   std::size_t fNumCols;
 
+  // position of the columns in a row, and the values of the ragged columns of the
+  // chunk being loaded
+  RColumnLayout fLayout;
+  RRaggedStaging fRaggedStaging;
+
   bool fNotFiltered;
   bool fShuffle;
+  // print the distributions of the ranges
+  bool fVerbose;
+
+  // read the ranges of a chunk directly from the TTree, if all columns are branches.
+  // Every worker thread has its own reader and its own share of the ranges
+  std::vector<std::unique_ptr<RRangeReader<Args...>>> fRangeReaders;
+  std::vector<RRangeRead> fChunkReads;
+  std::vector<std::vector<RRangeRead>> fWorkerReads;
+
+  // entries passing the filters of a filtered RDataFrame. The ranges and the cache
+  // are defined over the passing entries, and translated to reads of the dataset
+  std::unique_ptr<REntryIndex> fEntryIndex;
+  std::vector<RRangeRead> fEntryReads;
+
+  // optional on-disk cache of the decoded columns, filled during the first epoch
+  std::unique_ptr<RChunkCache> fCache;
+  TMVA::Experimental::RTensor<float> fCacheTensor{std::vector<std::size_t>({0})};
+
+  // the entry of the chunk i is written to row fPermutation[i], which shuffles the
+  // chunk while it is filled. Reused for every chunk
+  std::vector<std::size_t> fPermutation;
+
+  // all random streams are derived from the seed, the epoch and the chunk
+  std::uint64_t fSeed;
+
+  // processes sharing the dataset split it into fWorldSize contiguous blocks, starting
+  // at fBlockBegins. Process fRank plans its ranges and chunks over the fNumEntries
+  // entries starting at entry fEntryOffset, the beginning of its block fBlock
+  std::size_t fWorldSize;
+  std::size_t fRank;
+  std::vector<std::size_t> fBlockBegins;
+  std::size_t fBlock = 0;
+  std::size_t fEntryOffset = 0;
+  std::size_t fTrainEpoch = 0;
+  std::size_t fValidationEpoch = 0;
+
+  // time spent reading the ranges and creating the permutations of the chunks
+  RStageTimer fReadTimer;
+  RStageTimer fShuffleTimer;
+
+  enum ERandomStream : std::uint32_t {
+    kRangeSizes, kRangeSplit, kTrainRanges, kValidationRanges, kTrainChunk, kValidationChunk, kBlocks
+  };
+
+  // the blocks only start at cluster boundaries if every block spans this many clusters
+  static constexpr std::size_t kMinBlockClusters = 4;
 
  public:
   RChunkLoader(ROOT::RDF::RNode &rdf, const std::size_t chunkSize, const std::size_t rangeSize,
-               const float validationSplit, const std::vector<std::string> &cols, bool shuffle)
+               const float validationSplit, const std::vector<std::string> &cols, bool shuffle,
+               bool clusterAware = false, std::size_t numThreads = 1, Long64_t seed = -1,
+               const std::string &cachePath = "", std::size_t worldSize = 1, std::size_t rank = 0,
+               const std::string &entryIndexPath = "", const std::vector<std::size_t> &vecSizes = {},
+               float vecPadding = 0, bool ragged = false, std::size_t numTargetColumns = 0,
+               std::size_t batchSize = 1, bool verbose = true)
     : f_rdf(rdf),
       fCols(cols),      
       fChunkSize(chunkSize),
       fRangeSize(rangeSize),
       fValidationSplit(validationSplit),
       fNotFiltered(f_rdf.GetFilterNames().empty()),
-      fShuffle(shuffle)
+      fShuffle(shuffle),
+      fWorldSize(std::max<std::size_t>(worldSize, 1)),
+      fRank(rank),
+      fVerbose(verbose)
   {
+    // the entry index and the cache of a filtered RDataFrame are only stored if the
+    // filters can be identified in their key
+    const bool storeFilters = fNotFiltered || HasNamedFilters();
+
     if (fNotFiltered) {
       fNumEntries = f_rdf.Count().GetValue();
+    } else {
+      if (!entryIndexPath.empty() && !storeFilters) {
+        std::cout << "Entry index is not stored for filters without a name, evaluating the filters" << std::endl;
+      } else if (!entryIndexPath.empty()) {
+        std::cout << "Entry index " << entryIndexPath << " identifies the filters by their names only, "
+                  << "remove it when a filter changes" << std::endl;
+      }
+
+      fEntryIndex = std::make_unique<REntryIndex>(f_rdf, storeFilters ? entryIndexPath : "", CreateDatasetKey());
+      fNumEntries = fEntryIndex->GetSize();
+    }
+
+    // the rows of a chunk are stored in one block per batch, with the features and the
+    // targets of the batch in two contiguous blocks
+    fLayout = RColumnLayout({ROOT::Internal::RDF::IsDataContainer<Args>::value...}, vecSizes, vecPadding, ragged,
+                            numTargetColumns, batchSize);
+    fNumCols = fLayout.fRowSize;
+
+    CreateRangeReaders(clusterAware, std::max<std::size_t>(numThreads, 1));
+
+    // RDataFrame can only read the entries of the filtered node, which evaluates the
+    // filters again for every range that is read
+    if (fEntryIndex && fRangeReaders.empty()) {
+      std::cout << "Not all columns are branches of the tree, the filters are evaluated again every epoch"
+                << std::endl;
+    }
+
+    // the processes only agree on their blocks if they draw them from the same seed
+    if (fWorldSize > 1 && seed < 0) {
+      throw std::invalid_argument("RChunkLoader: a seed shared by all processes is required when worldSize > 1");
     }
 
-    fNumCols = fCols.size();
+    if (fRank >= fWorldSize) {
+      throw std::invalid_argument("RChunkLoader: rank " + std::to_string(fRank) + " is not smaller than worldSize " +
+                                  std::to_string(fWorldSize));
+    }
+
+    // without a seed the runs are not reproducible
+    fSeed = seed < 0 ? (static_cast<std::uint64_t>(std::random_device{}()) << 32) | std::random_device{}()
+                     : static_cast<std::uint64_t>(seed);
+
+    if (fWorldSize > 1) {
+      CreateBlocks();
+      SetBlock(0);
+    }
+
+    // the cache only holds the rows of a chunk. Every block of a sharded dataset has
+    // its own cache, so a process keeps its first block for all epochs
+    if (!cachePath.empty() && fLayout.fNumRagged > 0) {
+      std::cout << "Chunk cache is not supported for ragged columns, reading from the dataset" << std::endl;
+    } else if (!cachePath.empty() && !storeFilters) {
+      std::cout << "Chunk cache is not supported for filters without a name, reading from the dataset" << std::endl;
+    } else if (!cachePath.empty()) {
+      std::string path = cachePath;
+      if (fWorldSize > 1) {
+        path += ".block" + std::to_string(fBlock) + "of" + std::to_string(fWorldSize);
+      }
+
+      fCache = std::make_unique<RChunkCache>(path, CreateCacheKey(), fNumEntries, fNumCols);
+      if (!fCache->IsOpen()) {
+        fCache.reset();
+      }
+    }
 
     // number of training and validation entries after the split
     fNumValidationEntries = static_cast<std::size_t>(fValidationSplit * fNumEntries);
@@ -217,9 +363,358 @@ class RChunkLoader {
     fTotEntriesFromRanges = fTotNumFullRanges * fRangeSize + fTotNumReminderRanges * fFullChunkReminderRangeSize + fNumReminderTrainChunkReminderRanges * fReminderTrainChunkReminderRangeSize +  fNumReminderValidationChunkReminderRanges * fReminderValidationChunkReminderRangeSize;
   }
 
+  /// \brief Create the readers that load the ranges of a chunk in a single pass,
+  /// one for each worker thread.
+  /// Defined columns can only be computed by RDataFrame, in which case every range
+  /// is loaded with its own event loop on a single thread. For a filtered RDataFrame
+  /// these event loops evaluate the filters again.
+  void CreateRangeReaders(bool clusterAware, std::size_t numThreads) {
+    auto definedCols = f_rdf.GetDefinedColumnNames();
+    for (const auto &col : fCols) {
+      if (std::find(definedCols.begin(), definedCols.end(), col) != definedCols.end()) {
+        return;
+      }
+    }
+
+    auto treeNames = ROOT::Internal::RDF::GetTreeFullPaths(f_rdf);
+    auto fileNames = ROOT::Internal::RDF::GetTopLevelFileNames(f_rdf);
+    if (treeNames.size() != 1 || fileNames.empty()) {
+      return;
+    }
+
+    if (numThreads > 1) {
+      ROOT::EnableThreadSafety();
+    }
+
+    // columns that RDataFrame reads from friend trees or aliases are not branches of the chain
+    auto reader = std::make_unique<RRangeReader<Args...>>(treeNames[0], fileNames, fCols, fLayout, clusterAware);
+    if (!reader->IsSetUp()) {
+      std::cout << "Not all columns can be read from the tree directly, reading the ranges with RDataFrame"
+                << std::endl;
+      return;
+    }
+
+    fRangeReaders.push_back(std::move(reader));
+    for (std::size_t i = 1; i < numThreads; i++) {
+      fRangeReaders.push_back(std::make_unique<RRangeReader<Args...>>(treeNames[0], fileNames, fCols, fLayout, clusterAware));
+    }
+    fWorkerReads.resize(numThreads);
+  }
+
+  /// \brief Split the dataset into fWorldSize contiguous blocks of fNumEntries / fWorldSize
+  /// entries each. If the dataset has enough clusters, the block k starts at the last
+  /// cluster boundary before k / fWorldSize of the entries, and reads up to a cluster
+  /// past its end into the next block. Otherwise the blocks start at any entry.
+  void CreateBlocks() {
+    const std::size_t numEntries = fNumEntries / fWorldSize;
+    if (numEntries < fChunkSize) {
+      throw std::invalid_argument("RChunkLoader: every one of the " + std::to_string(fWorldSize) +
+                                  " processes gets " + std::to_string(numEntries) +
+                                  " entries, fewer than the chunk size " + std::to_string(fChunkSize));
+    }
+
+    // cluster boundaries as positions among the entries of the RDataFrame
+    std::vector<std::size_t> boundaries;
+    auto treeNames = ROOT::Internal::RDF::GetTreeFullPaths(f_rdf);
+    auto fileNames = ROOT::Internal::RDF::GetTopLevelFileNames(f_rdf);
+    if (treeNames.size() == 1 && !fileNames.empty()) {
+      TChain chain(treeNames[0].c_str());
+      for (const auto &fileName : fileNames) {
+        chain.Add(fileName.c_str());
+      }
+
+      for (Long64_t entry : GetClusterBoundaries(chain)) {
+        boundaries.push_back(fEntryIndex ? fEntryIndex->GetPosition(entry) : entry);
+      }
+      boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    }
+
+    const bool alignToClusters = boundaries.size() > kMinBlockClusters * fWorldSize;
+
+    fBlockBegins.clear();
+    for (std::size_t i = 0; i < fWorldSize; i++) {
+      // the blocks never start later than i / fWorldSize of the entries, so the last
+      // one ends within the dataset
+      std::size_t begin = i * fNumEntries / fWorldSize;
+      if (alignToClusters) {
+        begin = *(std::upper_bound(boundaries.begin(), boundaries.end(), begin) - 1);
+      }
+      fBlockBegins.push_back(begin);
+    }
+
+    if (fVerbose) {
+      std::cout << "Splitting " << fNumEntries << " entries into " << fWorldSize << " blocks of " << numEntries
+                << (alignToClusters ? " entries at cluster boundaries" : " entries") << std::endl;
+    }
+
+    fNumEntries = numEntries;
+  }
+
+  /// \brief Assign the blocks to the processes for the given epoch, with a permutation
+  /// drawn from the seed, so that all processes agree on it
+  void SetBlock(std::size_t epoch) {
+    std::vector<std::size_t> blocks(fWorldSize);
+    std::iota(blocks.begin(), blocks.end(), 0);
+    std::mt19937 g = CreateGenerator(kBlocks, epoch);
+    std::shuffle(blocks.begin(), blocks.end(), g);
+
+    fBlock = blocks[fRank];
+    fEntryOffset = fBlockBegins[fBlock];
+  }
+
+  /// \brief Split the ranges of a chunk, sorted by entry, into consecutive groups
+  /// with about the same number of entries, and read each group on its own thread.
+  /// Every entry is written to its own row of the chunk tensor, so the workers
+  /// never write to the same memory. The first error of a worker is rethrown once
+  /// all of them have finished.
+  void ReadRangesParallel(std::vector<RRangeRead> &chunkReads, TMVA::Experimental::RTensor<float> &Tensor,
+                          const std::size_t *rowPermutation) {
+    std::sort(chunkReads.begin(), chunkReads.end(),
+              [](const RRangeRead &a, const RRangeRead &b) { return a.fBegin < b.fBegin; });
+
+    std::size_t numEntries = 0;
+    for (const auto &read : chunkReads) {
+      numEntries += read.fEnd - read.fBegin;
+    }
+
+    const std::size_t numWorkers = fRangeReaders.size();
+    for (auto &reads : fWorkerReads) {
+      reads.clear();
+    }
+
+    std::size_t worker = 0;
+    std::size_t workerEntries = 0;
+    for (const auto &read : chunkReads) {
+      if (workerEntries * numWorkers >= numEntries * (worker + 1) && worker + 1 < numWorkers) {
+        worker++;
+      }
+      fWorkerReads[worker].push_back(read);
+      workerEntries += read.fEnd - read.fBegin;
+    }
+
+    std::vector<std::exception_ptr> exceptions(numWorkers);
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < numWorkers; i++) {
+      if (!fWorkerReads[i].empty()) {
+        workers.emplace_back([this, i, &Tensor, rowPermutation, &exceptions]() {
+          try {
+            fRangeReaders[i]->ReadRanges(fWorkerReads[i], Tensor, rowPermutation, &fRaggedStaging, i);
+          } catch (...) {
+            exceptions[i] = std::current_exception();
+          }
+        });
+      }
+    }
+
+    for (auto &thread : workers) {
+      thread.join();
+    }
+
+    for (const auto &exception : exceptions) {
+      if (exception) {
+        std::rethrow_exception(exception);
+      }
+    }
+  }
+
+  /// \brief Load the ranges [firstRange, firstRange + numRanges) into the chunk tensor.
+  /// The i-th entry of the ranges, in the order of the range vector, is stored in row
+  /// fPermutation[i] of the tensor.
+  void FillChunk(TMVA::Experimental::RTensor<float> &Tensor, const std::vector<std::pair<Long64_t,Long64_t>> &ranges,
+                 std::size_t firstRange, std::size_t numRanges) {
+    fChunkReads.clear();
+
+    std::size_t chunkEntry = 0;
+    for (std::size_t i = firstRange; i < firstRange + numRanges; i++) {
+      fChunkReads.push_back({ranges[i].first, ranges[i].second, chunkEntry});
+      chunkEntry += ranges[i].second - ranges[i].first;
+    }
+
+    if (fLayout.fNumRagged > 0) {
+      fRaggedStaging.Reset(std::max<std::size_t>(fRangeReaders.size(), 1), fLayout.fNumRagged, chunkEntry);
+    }
+
+    if (!fCache) {
+      ReadRanges(Tensor, fPermutation.data());
+      return;
+    }
+
+    // copy the cached ranges, read the other ones from the dataset and add them to the cache
+    auto uncached = std::partition(fChunkReads.begin(), fChunkReads.end(),
+                                   [this](const RRangeRead &read) { return !fCache->IsCached(read.fBegin); });
+
+    for (auto read = uncached; read != fChunkReads.end(); read++) {
+      fCache->ReadRange(read->fBegin, read->fEnd, Tensor.GetData(), read->fRow, fPermutation.data(), fLayout);
+    }
+    fChunkReads.erase(uncached, fChunkReads.end());
+
+    ReadRanges(Tensor, fPermutation.data());
+
+    for (const auto &read : fChunkReads) {
+      fCache->WriteRange(read.fBegin, read.fEnd, Tensor.GetData(), read.fRow, fPermutation.data(), fLayout);
+    }
+  }
+
+  /// \brief Read the ranges in fChunkReads from the dataset into the tensor.
+  /// The ranges are over the entries of the block of this process. For a filtered
+  /// RDataFrame they are over the passing entries. The range readers read each one
+  /// as the runs of consecutive passing entries it covers, while RDataFrame reads it
+  /// with a single event loop from its first to its last passing entry, in which
+  /// the filters drop the other entries.
+  void ReadRanges(TMVA::Experimental::RTensor<float> &Tensor, const std::size_t *rowPermutation) {
+    std::vector<RRangeRead> &chunkReads = fEntryIndex || fEntryOffset > 0 ? fEntryReads : fChunkReads;
+    const Long64_t offset = fEntryOffset;
+
+    fEntryReads.clear();
+    for (const auto &read : fChunkReads) {
+      if (fEntryIndex && !fRangeReaders.empty()) {
+        fEntryIndex->AppendReads(read.fBegin + offset, read.fEnd + offset, read.fRow, fEntryReads);
+      } else if (fEntryIndex) {
+        fEntryReads.push_back({fEntryIndex->GetEntry(read.fBegin + offset),
+                               fEntryIndex->GetEntry(read.fEnd + offset - 1) + 1, read.fRow});
+      } else if (fEntryOffset > 0) {
+        fEntryReads.push_back({read.fBegin + offset, read.fEnd + offset, read.fRow});
+      }
+    }
+
+    if (fRangeReaders.size() == 1) {
+      fRangeReaders[0]->ReadRanges(chunkReads, Tensor, rowPermutation, &fRaggedStaging, 0);
+      return;
+    }
+
+    if (fRangeReaders.size() > 1) {
+      ReadRangesParallel(chunkReads, Tensor, rowPermutation);
+      return;
+    }
+
+    // read the ranges in entry order to reuse the baskets between consecutive ranges
+    std::sort(chunkReads.begin(), chunkReads.end(),
+              [](const RRangeRead &a, const RRangeRead &b) { return a.fBegin < b.fBegin; });
+
+    // the functor writes the entries that pass the filters to consecutive rows
+    for (const auto &read : chunkReads) {
+      RRangeChunkLoaderFunctor<Args...> func(Tensor, read.fRow, fLayout, rowPermutation, &fRaggedStaging);
+      ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, read.fBegin, read.fEnd);
+      f_rdf.Foreach(func, fCols);
+    }
+  }
+
+  /// \brief Whether every filter of the RDataFrame has a name. RDataFrame only exposes
+  /// the names of the filters, so filters without a name can not be told apart in a key.
+  bool HasNamedFilters() {
+    auto filterNames = f_rdf.GetFilterNames();
+    return std::find(filterNames.begin(), filterNames.end(), "Unnamed Filter") == filterNames.end();
+  }
+
+  /// \brief Key of the dataset: the tree, the files with their size and modification
+  /// time, and the names of the filters. A filter whose cut changes under the same
+  /// name is not detected.
+  std::string CreateDatasetKey() {
+    std::string key;
+    for (const auto &treeName : ROOT::Internal::RDF::GetTreeFullPaths(f_rdf)) {
+      key += "tree:" + treeName + "\n";
+    }
+
+    for (const auto &fileName : ROOT::Internal::RDF::GetTopLevelFileNames(f_rdf)) {
+      FileStat_t stat;
+      key += "file:" + fileName;
+      if (gSystem->GetPathInfo(fileName.c_str(), stat) == 0) {
+        key += " " + std::to_string(stat.fSize) + " " + std::to_string(stat.fMtime);
+      }
+      key += "\n";
+    }
+
+    for (const auto &filter : f_rdf.GetFilterNames()) {
+      key += "filter:" + filter + "\n";
+    }
+
+    return key;
+  }
+
+  /// \brief Key of the chunk cache. The cache is rebuilt when the dataset, the block
+  /// of the dataset, or the names and types of the columns change.
+  std::string CreateCacheKey() {
+    std::string key = CreateDatasetKey();
+    key += "block:" + std::to_string(fEntryOffset) + " " + std::to_string(fNumEntries) + "\n";
+    for (const auto &col : fCols) {
+      key += "column:" + col + " " + f_rdf.GetColumnType(col) + "\n";
+    }
+
+    for (std::size_t size : fLayout.fSizes) {
+      key += "size:" + std::to_string(size) + "\n";
+    }
+
+    key += "padding:" + std::to_string(fLayout.fPadding) + "\n";
+    key += "dtype:float\n";
+    return key;
+  }
+
+  /// \brief Read the ranges that are not cached yet and add them to the cache, so
+  /// that it is complete and can be used by later runs. Called by the loading
+  /// thread after an epoch, since the reminder chunks are never loaded.
+  /// The ranges are read in groups of at most a chunk into fCacheTensor, which has
+  /// the layout of a chunk. Before every group keepLoading is checked, so that the
+  /// fill can be stopped with the epoch; it resumes after the next epoch.
+  void CompleteCache(const std::function<bool()> &keepLoading) {
+    if (!fCache || fCache->IsComplete()) {
+      return;
+    }
+
+    if (fCacheTensor.GetSize() == 0) {
+      fCacheTensor = TMVA::Experimental::RTensor<float>({fLayout.GetNumAllocatedRows(fChunkSize), fNumCols});
+    }
+
+    std::size_t i = 0;
+    while (i + 1 < fPartialSumRangeSizes.size() && keepLoading()) {
+      fChunkReads.clear();
+
+      std::size_t chunkEntry = 0;
+      for (; i + 1 < fPartialSumRangeSizes.size(); i++) {
+        const Long64_t begin = fPartialSumRangeSizes[i];
+        const Long64_t end = fPartialSumRangeSizes[i + 1];
+        const std::size_t size = end - begin;
+        if (fCache->IsCached(begin)) {
+          continue;
+        }
+        if (chunkEntry + size > fChunkSize && !fChunkReads.empty()) {
+          break;
+        }
+
+        fChunkReads.push_back({begin, end, chunkEntry});
+        chunkEntry += size;
+      }
+
+      ReadRanges(fCacheTensor, nullptr);
+
+      for (const auto &read : fChunkReads) {
+        fCache->WriteRange(read.fBegin, read.fEnd, fCacheTensor.GetData(), read.fRow, nullptr, fLayout);
+      }
+    }
+  }
+
+  /// \brief Random generator of the given stream. The same seed, stream, epoch and
+  /// chunk always give the same sequence, independent of the loading order.
+  std::mt19937 CreateGenerator(ERandomStream stream, std::size_t epoch = 0, std::size_t chunk = 0) {
+    std::seed_seq seq{static_cast<std::uint32_t>(fSeed), static_cast<std::uint32_t>(fSeed >> 32),
+                      static_cast<std::uint32_t>(stream), static_cast<std::uint32_t>(epoch),
+                      static_cast<std::uint32_t>(chunk)};
+    return std::mt19937(seq);
+  }
+
+  std::uint64_t GetSeed() {
+    return fSeed;
+  }
+
+  RStageTimer &GetReadTimer() {
+    return fReadTimer;
+  }
+
+  RStageTimer &GetShuffleTimer() {
+    return fShuffleTimer;
+  }
+
   void CreateRangeVector() {
-    std::random_device rd;
-    std::mt19937 g(rd());
+    std::mt19937 g = CreateGenerator(kRangeSizes);
 
     std::vector<Long_t> RangeSizes = {};
     RangeSizes.insert(RangeSizes.end(), fTotNumFullRanges, fRangeSize);
@@ -238,8 +733,7 @@ class RChunkLoader {
   
   void SortRangeVector() {
 
-    std::random_device rd;
-    std::mt19937 g(rd());
+    std::mt19937 g = CreateGenerator(kRangeSplit);
 
     for (int i = 0; i < fPartialSumRangeSizes.size() - 1; i++) {
       if (fPartialSumRangeSizes[i+1] - fPartialSumRangeSizes[i] == fRangeSize) {
@@ -272,7 +766,9 @@ class RChunkLoader {
       fValidationRangesReminder.push_back(fReminderRanges.back());
       fReminderRanges.pop_back();
 
-      std::cout << "i) Reminder range, reminder train range and reminder validation range are equal " << std::endl;
+      if (fVerbose) {
+        std::cout << "i) Reminder range, reminder train range and reminder validation range are equal " << std::endl;
+      }
     }
 
     else if ( fFullChunkReminderRangeSize == fReminderTrainChunkReminderRangeSize and
@@ -280,7 +776,9 @@ class RChunkLoader {
       fTrainRangesReminder.push_back(fReminderRanges.back());
       fReminderRanges.pop_back();
 
-      std::cout << "ii) Reminder range and reminder train range are equal " << std::endl;      
+      if (fVerbose) {
+        std::cout << "ii) Reminder range and reminder train range are equal " << std::endl;
+      }
     }    
 
     else if ( fFullChunkReminderRangeSize == fReminderValidationChunkReminderRangeSize and
@@ -288,7 +786,9 @@ class RChunkLoader {
       fValidationRangesReminder.push_back(fReminderRanges.back());
       fReminderRanges.pop_back();
 
-      std::cout << "iii) Reminder range and reminder validation range are equal " << std::endl;            
+      if (fVerbose) {
+        std::cout << "iii) Reminder range and reminder validation range are equal " << std::endl;
+      }
     }    
 
     else if ( fReminderTrainChunkReminderRangeSize == fReminderValidationChunkReminderRangeSize and
@@ -296,7 +796,9 @@ class RChunkLoader {
       fValidationRangesReminder.push_back(fTrainRangesReminder.back());
       fTrainRangesReminder.pop_back();
 
-      std::cout << "iv) Reminder train range and reminder validation range are equal " << std::endl;                  
+      if (fVerbose) {
+        std::cout << "iv) Reminder train range and reminder validation range are equal " << std::endl;
+      }
     }    
 
     
@@ -313,8 +815,12 @@ class RChunkLoader {
   void CreateTrainRangeVector()
   {
 
-    std::random_device rd;
-    std::mt19937 g(rd());
+    std::mt19937 g = CreateGenerator(kTrainRanges, ++fTrainEpoch);
+
+    // every epoch the processes train on other blocks, unless each one caches its block
+    if (fWorldSize > 1 && !fCache) {
+      SetBlock(fTrainEpoch);
+    }
     
     fTrainRanges = {};
 
@@ -345,8 +851,7 @@ class RChunkLoader {
 
   void CreateValidationRangeVector() {
 
-    std::random_device rd;
-    std::mt19937 g(rd());
+    std::mt19937 g = CreateGenerator(kValidationRanges, ++fValidationEpoch);
     
     fValidationRanges = {};
 
@@ -381,195 +886,60 @@ class RChunkLoader {
   }
   
   void LoadTrainingDataset(TMVA::Experimental::RTensor<float> &TrainTensor) {
-    TMVA::Experimental::RTensor<float> Tensor({fNumTrainEntries, fNumCols});     
-    TrainTensor = TrainTensor.Resize({{fNumTrainEntries, fNumCols}});
-
-    std::vector<int> indices(fNumTrainEntries);
-    std::iota(indices.begin(), indices.end(), 0);
-
-    std::random_device rd;
-    std::mt19937 g(rd());
-    
-    if (fShuffle) {
-      std::shuffle(indices.begin(), indices.end(), g);
-    }
-    
-    int chunkEntry = 0;
-    for (int i = 0; i < fTrainRanges.size(); i++) {
-      RRangeChunkLoaderFunctor<Args...> func(Tensor, chunkEntry, fNumCols);
-      ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, fTrainRanges[i].first, fTrainRanges[i].second);
-      f_rdf.Foreach(func, fCols);
-      chunkEntry += fTrainRanges[i].second - fTrainRanges[i].first;
-    }
-
-    for (int i = 0; i < fNumTrainEntries; i++) {
-    std::copy(Tensor.GetData() + indices[i] * fNumCols, Tensor.GetData() + (indices[i] + 1) * fNumCols,
-              TrainTensor.GetData() + i * fNumCols);
-      
-    }
+    TrainTensor = TrainTensor.Resize({{fLayout.GetNumAllocatedRows(fNumTrainEntries), fNumCols}});
+    LoadChunk(TrainTensor, fTrainRanges, 0, fTrainRanges.size(), fNumTrainEntries, CreateGenerator(kTrainChunk, fTrainEpoch));
   }
 
   void LoadValidationDataset(TMVA::Experimental::RTensor<float> &ValidationTensor) {
-    TMVA::Experimental::RTensor<float> Tensor({fNumValidationEntries, fNumCols});     
-    ValidationTensor = ValidationTensor.Resize({{fNumValidationEntries, fNumCols}});
-
-    std::vector<int> indices(fNumValidationEntries);
-    std::iota(indices.begin(), indices.end(), 0);
-
-    std::random_device rd;
-    std::mt19937 g(rd());
-    
-    if (fShuffle) {
-      std::shuffle(indices.begin(), indices.end(), g);
-    }
-    
-    int chunkEntry = 0;
-    for (int i = 0; i < fValidationRanges.size(); i++) {
-      RRangeChunkLoaderFunctor<Args...> func(Tensor, chunkEntry, fNumCols);
-      ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, fValidationRanges[i].first, fValidationRanges[i].second);
-      f_rdf.Foreach(func, fCols);
-      chunkEntry += fValidationRanges[i].second - fValidationRanges[i].first;
-    }
-
-    for (int i = 0; i < fNumValidationEntries; i++) {
-    std::copy(Tensor.GetData() + indices[i] * fNumCols, Tensor.GetData() + (indices[i] + 1) * fNumCols,
-              ValidationTensor.GetData() + i * fNumCols);
-      
-    }
-    
+    ValidationTensor = ValidationTensor.Resize({{fLayout.GetNumAllocatedRows(fNumValidationEntries), fNumCols}});
+    LoadChunk(ValidationTensor, fValidationRanges, 0, fValidationRanges.size(), fNumValidationEntries,
+              CreateGenerator(kValidationChunk, fValidationEpoch));
   }
 
+  /// \brief Load the ranges [firstRange, firstRange + numRanges) into the chunk tensor,
+  /// shuffling the entries with the given generator if shuffling is enabled.
+  /// The values of the ragged columns are laid out in the given ragged columns.
+  void LoadChunk(TMVA::Experimental::RTensor<float> &ChunkTensor, const std::vector<std::pair<Long64_t,Long64_t>> &ranges,
+                 std::size_t firstRange, std::size_t numRanges, std::size_t chunkSize, std::mt19937 g,
+                 RRaggedColumns *ragged = nullptr) {
+    {
+      RStageTimer::RScope scope(fShuffleTimer);
+      fPermutation.resize(chunkSize);
+      std::iota(fPermutation.begin(), fPermutation.end(), 0);
 
-  void LoadTrainChunk(TMVA::Experimental::RTensor<float> &TrainChunkTensor, std::size_t chunk) {
-
-    if (chunk < fNumFullTrainChunks) {
-      TMVA::Experimental::RTensor<float> Tensor({fChunkSize, fNumCols});     
-      TrainChunkTensor = TrainChunkTensor.Resize({{fChunkSize, fNumCols}});
-
-      std::vector<int> indices(fChunkSize);
-      std::iota(indices.begin(), indices.end(), 0);
-
-      std::random_device rd;
-      std::mt19937 g(rd());
-    
       if (fShuffle) {
-        std::shuffle(indices.begin(), indices.end(), g);
-      }
-    
-      std::size_t chunkEntry = 0;
-      for (std::size_t i = 0; i < fNumFullChunkRanges; i++) {
-        std::size_t entry = chunk*fNumFullChunkRanges + i;
-      
-        RRangeChunkLoaderFunctor<Args...> func(Tensor, chunkEntry, fNumCols);
-        ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, fTrainRanges[entry].first, fTrainRanges[entry].second);
-        f_rdf.Foreach(func, fCols);
-        chunkEntry += fTrainRanges[entry].second - fTrainRanges[entry].first;
-      }
-
-      for (std::size_t i = 0; i < fChunkSize; i++) {
-        std::copy(Tensor.GetData() + indices[i] * fNumCols, Tensor.GetData() + (indices[i] + 1) * fNumCols,
-                  TrainChunkTensor.GetData() + i * fNumCols);
-      
+        std::shuffle(fPermutation.begin(), fPermutation.end(), g);
       }
     }
 
-    else {
-      TMVA::Experimental::RTensor<float> Tensor({fReminderTrainChunkSize, fNumCols});     
-      TrainChunkTensor = TrainChunkTensor.Resize({{fReminderTrainChunkSize, fNumCols}});
-
-      std::vector<int> indices(fReminderTrainChunkSize);
-      std::iota(indices.begin(), indices.end(), 0);
+    RStageTimer::RScope scope(fReadTimer);
+    FillChunk(ChunkTensor, ranges, firstRange, numRanges);
 
-      std::random_device rd;
-      std::mt19937 g(rd());
-    
-      if (fShuffle) {
-        std::shuffle(indices.begin(), indices.end(), g);
-      }
-    
-      std::size_t chunkEntry = 0;
-      for (std::size_t i = 0; i < fNumReminderTrainChunkRanges; i++) {
-        std::size_t entry = chunk*fNumFullChunkRanges + i;
-      
-        RRangeChunkLoaderFunctor<Args...> func(Tensor, chunkEntry, fNumCols);
-        ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, fTrainRanges[entry].first, fTrainRanges[entry].second);
-        f_rdf.Foreach(func, fCols);
-        chunkEntry += fTrainRanges[entry].second - fTrainRanges[entry].first;
-      }
-
-      for (std::size_t i = 0; i < fReminderTrainChunkSize; i++) {
-        std::copy(Tensor.GetData() + indices[i] * fNumCols, Tensor.GetData() + (indices[i] + 1) * fNumCols,
-                  TrainChunkTensor.GetData() + i * fNumCols);
-      
-      }
+    if (ragged && fLayout.fNumRagged > 0) {
+      ragged->Fill(fRaggedStaging, chunkSize);
     }
-    
   }
 
-  void LoadValidationChunk(TMVA::Experimental::RTensor<float> &ValidationChunkTensor, std::size_t chunk) {
-
-    if (chunk < fNumFullValidationChunks) {
-      TMVA::Experimental::RTensor<float> Tensor({fChunkSize, fNumCols});     
-      ValidationChunkTensor = ValidationChunkTensor.Resize({{fChunkSize, fNumCols}});
-
-      std::vector<int> indices(fChunkSize);
-      std::iota(indices.begin(), indices.end(), 0);
-
-      std::random_device rd;
-      std::mt19937 g(rd());
-    
-      if (fShuffle) {
-        std::shuffle(indices.begin(), indices.end(), g);
-      }
-    
-      std::size_t chunkEntry = 0;
-      for (std::size_t i = 0; i < fNumFullChunkRanges; i++) {
-        std::size_t entry = chunk*fNumFullChunkRanges + i;
-      
-        RRangeChunkLoaderFunctor<Args...> func(Tensor, chunkEntry, fNumCols);
-        ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, fValidationRanges[entry].first, fValidationRanges[entry].second);
-        f_rdf.Foreach(func, fCols);
-        chunkEntry += fValidationRanges[entry].second - fValidationRanges[entry].first;
-      }
-
-      for (std::size_t i = 0; i < fChunkSize; i++) {
-        std::copy(Tensor.GetData() + indices[i] * fNumCols, Tensor.GetData() + (indices[i] + 1) * fNumCols,
-                  ValidationChunkTensor.GetData() + i * fNumCols);
-      
-      }
-    }
+  /// \brief Load a train chunk into the given tensor, which is not reallocated
+  /// and has to provide space for at least the entries of the chunk.
+  void LoadTrainChunk(TMVA::Experimental::RTensor<float> &TrainChunkTensor, std::size_t chunk,
+                      RRaggedColumns *ragged = nullptr) {
+    std::size_t numRanges = chunk < fNumFullTrainChunks ? fNumFullChunkRanges : fNumReminderTrainChunkRanges;
+    std::size_t chunkSize = chunk < fNumFullTrainChunks ? fChunkSize : fReminderTrainChunkSize;
 
-    else {
-      TMVA::Experimental::RTensor<float> Tensor({fReminderValidationChunkSize, fNumCols});     
-      ValidationChunkTensor = ValidationChunkTensor.Resize({{fReminderValidationChunkSize, fNumCols}});
+    LoadChunk(TrainChunkTensor, fTrainRanges, chunk*fNumFullChunkRanges, numRanges, chunkSize,
+              CreateGenerator(kTrainChunk, fTrainEpoch, chunk), ragged);
+  }
 
-      std::vector<int> indices(fReminderValidationChunkSize);
-      std::iota(indices.begin(), indices.end(), 0);
+  /// \brief Load a validation chunk into the given tensor, which is not reallocated
+  /// and has to provide space for at least the entries of the chunk.
+  void LoadValidationChunk(TMVA::Experimental::RTensor<float> &ValidationChunkTensor, std::size_t chunk,
+                      RRaggedColumns *ragged = nullptr) {
+    std::size_t numRanges = chunk < fNumFullValidationChunks ? fNumFullChunkRanges : fNumReminderValidationChunkRanges;
+    std::size_t chunkSize = chunk < fNumFullValidationChunks ? fChunkSize : fReminderValidationChunkSize;
 
-      std::random_device rd;
-      std::mt19937 g(rd());
-    
-      if (fShuffle) {
-        std::shuffle(indices.begin(), indices.end(), g);
-      }
-    
-      std::size_t chunkEntry = 0;
-      for (std::size_t i = 0; i < fNumReminderValidationChunkRanges; i++) {
-        std::size_t entry = chunk*fNumFullChunkRanges + i;
-      
-        RRangeChunkLoaderFunctor<Args...> func(Tensor, chunkEntry, fNumCols);
-        ROOT::Internal::RDF::ChangeBeginAndEndEntries(f_rdf, fValidationRanges[entry].first, fValidationRanges[entry].second);
-        f_rdf.Foreach(func, fCols);
-        chunkEntry += fValidationRanges[entry].second - fValidationRanges[entry].first;
-      }
-
-      for (std::size_t i = 0; i < fReminderValidationChunkSize; i++) {
-        std::copy(Tensor.GetData() + indices[i] * fNumCols, Tensor.GetData() + (indices[i] + 1) * fNumCols,
-                  ValidationChunkTensor.GetData() + i * fNumCols);
-      
-      }
-    }
-    
+    LoadChunk(ValidationChunkTensor, fValidationRanges, chunk*fNumFullChunkRanges, numRanges, chunkSize,
+              CreateGenerator(kValidationChunk, fValidationEpoch, chunk), ragged);
   }
 
   void CheckIfUnique(TMVA::Experimental::RTensor<float> &Tensor) {
@@ -636,10 +1006,26 @@ class RChunkLoader {
     return fNumValidationChunks;
   }
 
+  /// \brief Number of floats in a row of a chunk
+  std::size_t GetRowSize() {
+    return fNumCols;
+  }
+
+  std::size_t GetNumRaggedColumns() {
+    return fLayout.fNumRagged;
+  }
+
+  /// \brief Number of floats of the targets in a row of a chunk
+  std::size_t GetNumTargets() {
+    return fLayout.fNumTargets;
+  }
+
+  /// \brief Number of full training chunks loaded by this process every epoch
   std::size_t GetNumberOfFullTrainingChunks() {
     return fNumFullTrainChunks;
   }
 
+  /// \brief Number of full validation chunks loaded by this process every epoch
   std::size_t GetNumberOfFullValidationChunks() {
     return fNumFullValidationChunks;
   }
@@ -740,7 +1126,7 @@ class RChunkLoader {
               << std::endl;
   };
   
-  void PrintRowHeader(std::string title, string col1, string col2, string col3, string col4, int colWidthS, int colWidth) {
+  void PrintRowHeader(std::string title, std::string col1, std::string col2, std::string col3, std::string col4, int colWidthS, int colWidth) {
     std::cout << std::string(colWidthS + 4 * colWidth, '=') << std::endl;
     std::cout << std::left;
     std::cout << std::setw(colWidthS) << title 
@@ -753,7 +1139,7 @@ class RChunkLoader {
     
   };
 
-  void PrintRowHeaderB(std::string title, string col1, string col2, string col3, string col4, string col5, int colWidthS, int colWidth) {
+  void PrintRowHeaderB(std::string title, std::string col1, std::string col2, std::string col3, std::string col4, std::string col5, int colWidthS, int colWidth) {
     std::cout << std::string(colWidthS + 5 * colWidth, '=') << std::endl;
     std::cout << std::left;
     std::cout << std::setw(colWidthS) << title 
@@ -0,0 +1,205 @@
+#ifndef RCOLUMNLAYOUT_HXX
+#define RCOLUMNLAYOUT_HXX
+
+#include "TROOT.h"
+#include "ROOT/RDF/Utils.hxx"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/// \brief Values of the ragged columns of a chunk in the order they are read, with
+/// one buffer per reading thread and column, and the position of the values of
+/// every row of the chunk in these buffers.
+struct RRaggedStaging {
+  struct RRow {
+    std::size_t fWorker;
+    std::size_t fBegin;
+    std::size_t fSize;
+  };
+
+  // [worker][ragged column]
+  std::vector<std::vector<std::vector<float>>> fValues;
+  // [ragged column][row]
+  std::vector<std::vector<RRow>> fRows;
+
+  /// \brief Empty the buffers for a new chunk, keeping their memory
+  void Reset(std::size_t numWorkers, std::size_t numRagged, std::size_t numRows)
+  {
+    fValues.resize(numWorkers);
+    for (auto &workerValues : fValues) {
+      workerValues.resize(numRagged);
+      for (auto &values : workerValues) {
+        values.clear();
+      }
+    }
+
+    fRows.resize(numRagged);
+    for (auto &rows : fRows) {
+      rows.resize(numRows);
+    }
+  }
+
+  template <typename T>
+  void Append(std::size_t worker, std::size_t col, std::size_t row, const T &values)
+  {
+    auto &buffer = fValues[worker][col];
+    const std::size_t size = values.size();
+    fRows[col][row] = {worker, buffer.size(), size};
+    for (std::size_t i = 0; i < size; i++) {
+      buffer.push_back(static_cast<float>(values[i]));
+    }
+  }
+};
+
+/// \brief Ragged columns of a chunk in CSR layout. The values of the rows of a batch
+/// are contiguous, and every batch has its own batchSize + 1 offsets starting at 0,
+/// so that a batch is handed out as views into the values and offsets.
+struct RRaggedColumns {
+  std::size_t fBatchSize = 0;
+
+  // [ragged column]
+  std::vector<std::vector<float>> fValues;
+  std::vector<std::vector<Long64_t>> fOffsets;
+  // first value of every batch, followed by the number of values
+  std::vector<std::vector<std::size_t>> fBatchBegins;
+
+  /// \brief Lay out the values of the rows [0, numRows) of the staging buffers
+  void Fill(const RRaggedStaging &staging, std::size_t numRows)
+  {
+    const std::size_t numRagged = staging.fRows.size();
+    fValues.resize(numRagged);
+    fOffsets.resize(numRagged);
+    fBatchBegins.resize(numRagged);
+
+    for (std::size_t col = 0; col < numRagged; col++) {
+      auto &values = fValues[col];
+      auto &offsets = fOffsets[col];
+      auto &batchBegins = fBatchBegins[col];
+      values.clear();
+      offsets.clear();
+      batchBegins.clear();
+
+      for (std::size_t row = 0; row < numRows; row++) {
+        if (row % fBatchSize == 0) {
+          batchBegins.push_back(values.size());
+          offsets.push_back(0);
+        }
+
+        const auto &stagedRow = staging.fRows[col][row];
+        const float *begin = staging.fValues[stagedRow.fWorker][col].data() + stagedRow.fBegin;
+        values.insert(values.end(), begin, begin + stagedRow.fSize);
+        offsets.push_back(values.size() - batchBegins.back());
+      }
+
+      batchBegins.push_back(values.size());
+    }
+  }
+};
+
+/// \brief Layout of the columns in the rows of a chunk. A scalar column takes one
+/// float, a padded container column a fixed number of floats, truncated or padded
+/// with fPadding, and a ragged container column none: its values are staged apart
+/// and handed out in CSR layout.
+///
+/// The last fNumTargetColumns columns are the targets. The rows of a chunk are
+/// stored in blocks of fBlockSize rows, one block per batch: the features of all
+/// rows of the block, followed by the targets of all rows of the block, so that the
+/// features and the targets of a batch are both contiguous. With a block size of 1
+/// the rows are stored one after the other.
+struct RColumnLayout {
+  // floats of every column in a row, 0 for ragged columns
+  std::vector<std::size_t> fSizes;
+  // first float of every column in a row
+  std::vector<std::size_t> fOffsets;
+  // index of every column among the ragged columns, kNotRagged for the other columns
+  std::vector<std::size_t> fRaggedIndices;
+
+  static constexpr std::size_t kNotRagged = static_cast<std::size_t>(-1);
+
+  std::size_t fRowSize = 0;
+  std::size_t fNumRagged = 0;
+  float fPadding = 0;
+
+  // floats of the features and of the targets in a row
+  std::size_t fNumFeatures = 0;
+  std::size_t fNumTargets = 0;
+  std::size_t fBlockSize = 1;
+
+  RColumnLayout() = default;
+
+  /// \brief Layout of the given columns. vecSizes gives the size of every padded
+  /// container column, and is ignored for scalar columns and in ragged mode.
+  RColumnLayout(const std::vector<bool> &isContainer, const std::vector<std::size_t> &vecSizes, float padding,
+                bool ragged, std::size_t numTargetColumns = 0, std::size_t blockSize = 1)
+    : fPadding(padding),
+      fBlockSize(std::max<std::size_t>(blockSize, 1))
+  {
+    for (std::size_t i = 0; i < isContainer.size(); i++) {
+      std::size_t size = 1;
+      if (isContainer[i]) {
+        size = ragged ? 0 : (i < vecSizes.size() ? vecSizes[i] : 0);
+      }
+
+      if (i + numTargetColumns == isContainer.size()) {
+        fNumFeatures = fRowSize;
+      }
+
+      fSizes.push_back(size);
+      fOffsets.push_back(fRowSize);
+      fRaggedIndices.push_back(isContainer[i] && ragged ? fNumRagged++ : kNotRagged);
+      fRowSize += size;
+    }
+
+    if (numTargetColumns == 0) {
+      fNumFeatures = fRowSize;
+    }
+    fNumTargets = fRowSize - fNumFeatures;
+  }
+
+  /// \brief Number of rows to allocate for numRows rows, a multiple of the block size
+  std::size_t GetNumAllocatedRows(std::size_t numRows) const
+  {
+    return (numRows + fBlockSize - 1) / fBlockSize * fBlockSize;
+  }
+
+  /// \brief Features of the given row of a chunk
+  float *GetFeatures(float *data, std::size_t row) const
+  {
+    return data + row / fBlockSize * fBlockSize * fRowSize + row % fBlockSize * fNumFeatures;
+  }
+
+  /// \brief Targets of the given row of a chunk
+  float *GetTargets(float *data, std::size_t row) const
+  {
+    return data + row / fBlockSize * fBlockSize * fRowSize + fBlockSize * fNumFeatures + row % fBlockSize * fNumTargets;
+  }
+
+  /// \brief Write the value of column col of an entry to its row of the chunk
+  template <typename T, typename V>
+  void Write(std::size_t col, const V &value, float *data, std::size_t row, RRaggedStaging *staging,
+             std::size_t worker) const
+  {
+    if constexpr (ROOT::Internal::RDF::IsDataContainer<T>::value) {
+      if (fRaggedIndices[col] != kNotRagged) {
+        staging->Append(worker, fRaggedIndices[col], row, value);
+        return;
+      }
+    }
+
+    float *dest = fOffsets[col] < fNumFeatures ? GetFeatures(data, row) + fOffsets[col]
+                                               : GetTargets(data, row) + fOffsets[col] - fNumFeatures;
+
+    if constexpr (ROOT::Internal::RDF::IsDataContainer<T>::value) {
+      const std::size_t size = std::min<std::size_t>(value.size(), fSizes[col]);
+      for (std::size_t i = 0; i < size; i++) {
+        dest[i] = static_cast<float>(value[i]);
+      }
+      std::fill(dest + size, dest + fSizes[col], fPadding);
+    } else {
+      *dest = static_cast<float>(value);
+    }
+  }
+};
+
+#endif // RCOLUMNLAYOUT_HXX
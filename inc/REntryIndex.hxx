@@ -0,0 +1,139 @@
+#ifndef RENTRYINDEX_HXX
+#define RENTRYINDEX_HXX
+
+#include "TROOT.h"
+
+#include "ROOT/RDataFrame.hxx"
+#include "RRangeReader.hxx"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/// \brief Sorted list of the entries of the dataset that pass the filters of an
+/// RDataFrame. The filters are evaluated once, and the ranges and chunks are
+/// defined over the passing entries: the i-th passing entry is entry fEntries[i]
+/// of the dataset.
+///
+/// The index can be stored in a file together with a key describing the dataset
+/// and the filters, and is read back by later runs instead of evaluating the
+/// filters again.
+class REntryIndex {
+ private:
+  static constexpr const char *kMagic = "RBGINDEX";
+
+  std::vector<Long64_t> fEntries;
+
+  bool Read(const std::string &path, const std::string &key)
+  {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+      return false;
+
+    char magic[8];
+    std::uint64_t keySize = 0;
+    std::uint64_t numEntries = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char *>(&keySize), sizeof(keySize));
+    if (!file || std::strncmp(magic, kMagic, sizeof(magic)) != 0 || keySize != key.size())
+      return false;
+
+    std::string fileKey(keySize, '\0');
+    file.read(&fileKey[0], keySize);
+    file.read(reinterpret_cast<char *>(&numEntries), sizeof(numEntries));
+    if (!file || fileKey != key)
+      return false;
+
+    fEntries.resize(numEntries);
+    file.read(reinterpret_cast<char *>(fEntries.data()), numEntries * sizeof(Long64_t));
+    if (!file) {
+      fEntries.clear();
+      return false;
+    }
+
+    return true;
+  }
+
+  /// \brief Write the index to a temporary file renamed to path, so that other
+  /// processes never read a partial index
+  void Write(const std::string &path, const std::string &key)
+  {
+    const std::string tmpPath = path + ".tmp." + std::to_string(getpid());
+    const std::uint64_t keySize = key.size();
+    const std::uint64_t numEntries = fEntries.size();
+
+    {
+      std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+      file.write(kMagic, 8);
+      file.write(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+      file.write(key.data(), keySize);
+      file.write(reinterpret_cast<const char *>(&numEntries), sizeof(numEntries));
+      file.write(reinterpret_cast<const char *>(fEntries.data()), numEntries * sizeof(Long64_t));
+
+      if (file.good()) {
+        file.close();
+        if (std::rename(tmpPath.c_str(), path.c_str()) == 0) {
+          return;
+        }
+      }
+    }
+
+    std::remove(tmpPath.c_str());
+    std::cout << "Entry index " << path << " could not be written" << std::endl;
+  }
+
+ public:
+  /// \brief Read the index from path if its key matches, otherwise evaluate the
+  /// filters of the RDataFrame and store the index in path. Without a path the
+  /// filters are evaluated and the index is only kept in memory.
+  REntryIndex(ROOT::RDF::RNode &rdf, const std::string &path, const std::string &key)
+  {
+    if (!path.empty() && Read(path, key)) {
+      std::cout << "Using entry index " << path << std::endl;
+      return;
+    }
+
+    // the entries are not in order if the event loop runs on several threads
+    auto entries = rdf.Take<ULong64_t>("rdfentry_");
+    fEntries.assign(entries->begin(), entries->end());
+    std::sort(fEntries.begin(), fEntries.end());
+
+    if (!path.empty()) {
+      Write(path, key);
+    }
+  }
+
+  /// \brief Number of entries passing the filters
+  std::size_t GetSize() const { return fEntries.size(); }
+
+  /// \brief Entry of the dataset of the passing entry at the given position
+  Long64_t GetEntry(std::size_t position) const { return fEntries[position]; }
+
+  /// \brief Number of entries passing the filters before the given entry of the dataset
+  std::size_t GetPosition(Long64_t entry) const
+  {
+    return std::lower_bound(fEntries.begin(), fEntries.end(), entry) - fEntries.begin();
+  }
+
+  /// \brief Append the reads of the entries [begin, end) of the index, starting at
+  /// the given row. Consecutive passing entries are merged into a single read.
+  void AppendReads(Long64_t begin, Long64_t end, std::size_t row, std::vector<RRangeRead> &reads) const
+  {
+    for (Long64_t i = begin; i < end; i++, row++) {
+      Long64_t entry = fEntries[i];
+      if (i > begin && reads.back().fEnd == entry) {
+        reads.back().fEnd++;
+      } else {
+        reads.push_back({entry, entry + 1, row});
+      }
+    }
+  }
+};
+
+#endif // RENTRYINDEX_HXX
@@ -0,0 +1,216 @@
+#ifndef RRANGEREADER_HXX
+#define RRANGEREADER_HXX
+
+#include "TMVA/RTensor.hxx"
+#include "TChain.h"
+#include "TTree.h"
+#include "TTreeReader.h"
+#include "TTreeReaderArray.h"
+#include "TTreeReaderValue.h"
+#include "TROOT.h"
+#include "RColumnLayout.hxx"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/// \brief A range of entries [fBegin, fEnd) that is copied to the rows starting
+/// at fRow of a chunk tensor
+struct RRangeRead {
+  Long64_t fBegin;
+  Long64_t fEnd;
+  std::size_t fRow;
+};
+
+/// \brief First entry of every cluster in the chain, followed by the number of entries
+inline std::vector<Long64_t> GetClusterBoundaries(TChain &chain)
+{
+  std::vector<Long64_t> boundaries;
+  const Long64_t numEntries = chain.GetEntries();
+  const Long64_t *treeOffsets = chain.GetTreeOffset();
+
+  for (int i = 0; i < chain.GetNtrees(); i++) {
+    chain.LoadTree(treeOffsets[i]);
+    TTree *tree = chain.GetTree();
+
+    auto clusterIterator = tree->GetClusterIterator(0);
+    Long64_t clusterStart;
+    while ((clusterStart = clusterIterator()) < tree->GetEntries()) {
+      boundaries.push_back(treeOffsets[i] + clusterStart);
+    }
+  }
+
+  boundaries.push_back(numEntries);
+  return boundaries;
+}
+
+/// \brief Container columns are read through a TTreeReaderArray of their elements
+template <typename T, bool = ROOT::Internal::RDF::IsDataContainer<T>::value>
+struct RReaderValue {
+  using Type = TTreeReaderValue<T>;
+};
+
+template <typename T>
+struct RReaderValue<T, true> {
+  using Type = TTreeReaderArray<typename T::value_type>;
+};
+
+/// \brief The elements of a TTreeReaderArray with the interface of a container
+template <typename T>
+struct RReaderArrayValues {
+  TTreeReaderArray<T> &fArray;
+
+  std::size_t size() const { return fArray.GetSize(); }
+
+  T operator[](std::size_t i) const { return fArray.At(i); }
+};
+
+/// \brief Reads the ranges of a chunk directly from the TTree in a single pass.
+/// The ranges are read in entry order through one TTreeReader, so each basket is
+/// decompressed at most once per chunk instead of once per range.
+template <typename... ColTypes>
+class RRangeReader {
+ private:
+  std::unique_ptr<TChain> fChain;
+  std::unique_ptr<TTreeReader> fReader;
+  std::tuple<std::unique_ptr<typename RReaderValue<ColTypes>::Type>...> fValues;
+
+  RColumnLayout fLayout;
+
+  // restrict the TTreeCache to the clusters that are touched by a chunk
+  bool fClusterAware;
+
+  // first entry of every cluster in the chain, followed by the number of entries
+  std::vector<Long64_t> fClusterBoundaries;
+
+  // whether every column could be read from the chain
+  bool fIsSetUp = false;
+
+  template <std::size_t... I>
+  void CreateValues(const std::vector<std::string> &cols, std::index_sequence<I...>)
+  {
+    ((std::get<I>(fValues) = std::make_unique<typename RReaderValue<ColTypes>::Type>(*fReader, cols[I].c_str())), ...);
+  }
+
+  template <std::size_t... I>
+  bool AreValuesSetUp(std::index_sequence<I...>) const
+  {
+    return ((std::get<I>(fValues)->GetSetupStatus() >= 0) && ...);
+  }
+
+  template <typename T>
+  static const T &GetValue(TTreeReaderValue<T> &value)
+  {
+    return *value.Get();
+  }
+
+  template <typename T>
+  static RReaderArrayValues<T> GetValue(TTreeReaderArray<T> &values)
+  {
+    return {values};
+  }
+
+  template <std::size_t... I>
+  void AssignToRow(float *data, std::size_t row, RRaggedStaging *staging, std::size_t worker,
+                   std::index_sequence<I...>)
+  {
+    (fLayout.template Write<ColTypes>(I, GetValue(*std::get<I>(fValues)), data, row, staging, worker), ...);
+  }
+
+  /// \brief First entry of the cluster that contains the given entry
+  Long64_t GetClusterBegin(Long64_t entry)
+  {
+    auto it = std::upper_bound(fClusterBoundaries.begin(), fClusterBoundaries.end(), entry);
+    return *(it - 1);
+  }
+
+  /// \brief Entry after the end of the cluster that contains the given entry
+  Long64_t GetClusterEnd(Long64_t entry)
+  {
+    return *std::upper_bound(fClusterBoundaries.begin(), fClusterBoundaries.end(), entry);
+  }
+
+ public:
+  RRangeReader(const std::string &treeName, const std::vector<std::string> &fileNames,
+               const std::vector<std::string> &cols, const RColumnLayout &layout, bool clusterAware)
+    : fChain(std::make_unique<TChain>(treeName.c_str())),
+      fLayout(layout),
+      fClusterAware(clusterAware)
+  {
+    for (const auto &fileName : fileNames) {
+      fChain->Add(fileName.c_str());
+    }
+
+    fChain->SetCacheSize(-1);
+    for (const auto &col : cols) {
+      fChain->AddBranchToCache(col.c_str(), true);
+    }
+    fChain->StopCacheLearningPhase();
+
+    if (fClusterAware) {
+      fClusterBoundaries = GetClusterBoundaries(*fChain);
+    }
+
+    fReader = std::make_unique<TTreeReader>(fChain.get());
+    CreateValues(cols, std::index_sequence_for<ColTypes...>{});
+
+    // the values are only set up once the first entry is loaded. Columns that are
+    // not branches of the chain, e.g. of friend trees or aliases, can not be read
+    fIsSetUp = fReader->SetEntry(0) == TTreeReader::kEntryValid &&
+               AreValuesSetUp(std::index_sequence_for<ColTypes...>{});
+  }
+
+  /// \brief Whether every column is a branch of the chain that can be read directly
+  bool IsSetUp() const { return fIsSetUp; }
+
+  /// \brief Read the given ranges into the chunk tensor.
+  /// The ranges are sorted by entry, and each one is written to its own rows of
+  /// the tensor, so the layout of the chunk is independent of the reading order.
+  /// If a permutation is given, the entry that belongs to row i is written to
+  /// row rowPermutation[i] instead. The values of the ragged columns are appended
+  /// to the staging buffers of the given worker.
+  void ReadRanges(std::vector<RRangeRead> &reads, TMVA::Experimental::RTensor<float> &chunkTensor,
+                  const std::size_t *rowPermutation = nullptr, RRaggedStaging *staging = nullptr,
+                  std::size_t worker = 0)
+  {
+    std::sort(reads.begin(), reads.end(),
+              [](const RRangeRead &a, const RRangeRead &b) { return a.fBegin < b.fBegin; });
+
+    float *data = chunkTensor.GetData();
+    Long64_t cacheEnd = -1;
+
+    for (std::size_t i = 0; i < reads.size(); i++) {
+      const auto &read = reads[i];
+
+      // prefetch the consecutive clusters touched by the following ranges with a single read
+      if (fClusterAware && read.fEnd > cacheEnd) {
+        Long64_t cacheBegin = GetClusterBegin(read.fBegin);
+        cacheEnd = GetClusterEnd(read.fEnd - 1);
+
+        for (std::size_t j = i + 1; j < reads.size() && GetClusterBegin(reads[j].fBegin) <= cacheEnd; j++) {
+          cacheEnd = std::max(cacheEnd, GetClusterEnd(reads[j].fEnd - 1));
+        }
+
+        fChain->SetCacheEntryRange(cacheBegin, cacheEnd - 1);
+      }
+
+      for (Long64_t entry = read.fBegin; entry < read.fEnd; entry++) {
+        std::size_t row = read.fRow + entry - read.fBegin;
+        if (rowPermutation) {
+          row = rowPermutation[row];
+        }
+
+        if (fReader->SetEntry(entry) != TTreeReader::kEntryValid) {
+          throw std::runtime_error("RRangeReader: entry " + std::to_string(entry) + " could not be read");
+        }
+        AssignToRow(data, row, staging, worker, std::index_sequence_for<ColTypes...>{});
+      }
+    }
+  }
+};
+
+#endif // RRANGEREADER_HXX
@@ -0,0 +1,45 @@
+#ifndef RSTAGETIMER_HXX
+#define RSTAGETIMER_HXX
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/// \brief Cumulative wall-clock time spent in one stage of the loading pipeline.
+/// The loading threads add to it while the consumer reads it, so the counters
+/// are atomic.
+class RStageTimer {
+ private:
+  std::atomic<std::uint64_t> fNanoseconds{0};
+  std::atomic<std::uint64_t> fCalls{0};
+
+ public:
+  /// \brief Adds the time between its construction and destruction to the timer
+  class RScope {
+   private:
+    RStageTimer &fTimer;
+    std::chrono::steady_clock::time_point fStart;
+
+   public:
+    RScope(RStageTimer &timer) : fTimer(timer), fStart(std::chrono::steady_clock::now()) {}
+
+    ~RScope()
+    {
+      auto elapsed = std::chrono::steady_clock::now() - fStart;
+      fTimer.fNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+      fTimer.fCalls++;
+    }
+  };
+
+  double GetSeconds() const { return fNanoseconds * 1e-9; }
+
+  std::uint64_t GetCalls() const { return fCalls; }
+
+  void Reset()
+  {
+    fNanoseconds = 0;
+    fCalls = 0;
+  }
+};
+
+#endif // RSTAGETIMER_HXX
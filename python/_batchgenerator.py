@@ -3,6 +3,7 @@ import ROOT
 ROOT.gInterpreter.Declare('#include "../inc/RBatchGenerator_python.hxx"')
 from typing import Any, Callable, Tuple, TYPE_CHECKING
 import atexit
+import weakref
 
 if TYPE_CHECKING:
     import numpy as np
@@ -10,6 +11,15 @@ if TYPE_CHECKING:
     import torch
 
 
+class BatchBuffer:
+    """Memory of a batch, exposed through the array interface. Keeps the
+    batch, and with it its chunk buffer, alive for as long as an array
+    created from it exists"""
+
+    def __init__(self, data: np.ndarray, batch: Any):
+        self.batch = batch
+        self.__array_interface__ = data.__array_interface__
+
 
 class BaseGenerator:
     def get_template(
@@ -19,7 +29,9 @@ class BaseGenerator:
     ) -> Tuple[str, list[int]]:
         """
         Generate a template for the RBatchGenerator based on the given
-        RDataFrame and columns.
+        RDataFrame and columns. The target columns are placed after the
+        other columns, so that the generator can store the features and
+        the targets of a batch in two contiguous blocks.
 
         Args:
             rdataframe (RNode): RDataFrame or RNode object.
@@ -33,12 +45,15 @@ class BaseGenerator:
         if not columns:
             columns = x_rdf.GetColumnNames()
 
+        columns = [str(c) for c in columns]
+        columns = [c for c in columns if c not in self.target_columns] + [
+            c for c in self.target_columns if c in columns]
+
         template_string = ""
 
         self.given_columns = []
         self.all_columns = []
-
-        max_vec_sizes_list = []
+        self.vec_columns = []
 
         for name in columns:
             name_str = str(name)
@@ -47,6 +62,9 @@ class BaseGenerator:
             template_string = f"{template_string}{column_type},"
             self.all_columns.append(name_str)
 
+            if "RVec" in column_type or "vector" in column_type:
+                self.vec_columns.append(name_str)
+
         return template_string[:-1]
 
     def __init__(
@@ -60,6 +78,18 @@ class BaseGenerator:
         target: str | list[str] = list(),
         validation_split: float = 0,
         shuffle: bool = True,
+        prefetch_depth: int = 2,
+        cluster_aware: bool = False,
+        num_threads: int = 1,
+        seed: int | None = None,
+        cache_path: str | None = None,
+        world_size: int = 1,
+        rank: int = 0,
+        entry_index_path: str | None = None,
+        max_vec_sizes: dict[str, int] = dict(),
+        vec_padding: int = 0,
+        ragged: bool = False,
+        verbose: bool = True,
     ):
         """Wrapper around the Cpp RBatchGenerator
 
@@ -71,9 +101,10 @@ class BaseGenerator:
                 results in better randomization, but also higher memory usage.
             columns (list[str], optional):
                 Columns to be returned. If not given, all columns are used.
-            max_vec_sizes (dict[std, int], optional):
-                Size of each column that consists of vectors.
-                Required when using vector based columns.
+            max_vec_sizes (dict[str, int], optional):
+                Size of each column that consists of vectors. Longer
+                vectors are truncated. Required when using vector based
+                columns, unless ragged is True.
             vec_padding (int):
                 Value to pad vectors with if the vector is smaller
                 than the given max vector length. Defaults is 0
@@ -94,6 +125,60 @@ class BaseGenerator:
             drop_remainder (bool):
                 Drop the remainder of data that is too small to compose full batch.
                 Defaults to True.
+            prefetch_depth (int):
+                The number of chunks the loading thread keeps loaded ahead of
+                the training loop. Defaults to 2.
+            cluster_aware (bool):
+                Prefetch only the TTree clusters touched by the ranges of a
+                chunk. Useful for small range sizes. Defaults to False.
+            num_threads (int):
+                The number of threads that read the ranges of a chunk in
+                parallel. Defaults to 1.
+            seed (int, optional):
+                Seed of the shuffling. Runs with the same seed and
+                configuration load the same batches. If not given, a
+                random seed is used.
+            cache_path (str, optional):
+                File in which the decoded columns are cached during the
+                first epoch. Later epochs and runs on the same files and
+                columns read from the cache instead of the dataset. Not
+                supported with ragged columns or filters without a name,
+                see entry_index_path. With world_size > 1 every
+                process caches its own block in cache_path.block<k>of<n>.
+            world_size (int):
+                The number of processes sharing the dataset, e.g. the DDP
+                world size. The dataset is split into world_size contiguous
+                blocks of the same size, which start at cluster boundaries
+                if the dataset has at least 4 clusters per block. Every
+                process plans its ranges and chunks within its own block, so
+                it only decodes the baskets of its block. The blocks are
+                assigned to the processes from the seed and the epoch, so
+                the processes switch blocks every epoch, unless cache_path
+                is given. Requires a seed shared by all processes, and at
+                least chunk_size entries per process.
+                Defaults to 1.
+            rank (int):
+                The rank of this process, from 0 to world_size - 1.
+                Defaults to 0.
+            entry_index_path (str, optional):
+                File in which the entries passing the filters of a
+                filtered RDataFrame are stored. Later runs on the same
+                files and filter names read it instead of evaluating the
+                filters. The filters are identified by their names only:
+                the index is not stored if a filter has no name, and has
+                to be removed when a cut changes under the same name. If
+                not given, the filters are evaluated once per run. The
+                filters are only skipped when loading the chunks if all
+                columns are branches of the tree; defined, friend or alias
+                columns are read with RDataFrame, which evaluates the
+                filters again every epoch.
+            ragged (bool):
+                Return the vector based columns in CSR layout instead of
+                padding them: for every batch, the values of the rows
+                and batch_size + 1 offsets into them. Defaults to False.
+            verbose (bool):
+                Print the distribution of the chunks and ranges when the
+                generator is created. Defaults to True.
         """
 
         import ROOT
@@ -120,6 +205,31 @@ class BaseGenerator:
                     given value is {validation_split}"
             )
 
+        if seed is not None and seed < 0:
+            raise ValueError(f"seed has to be non-negative: seed: {seed}")
+
+        if world_size < 1 or rank < 0 or rank >= world_size:
+            raise ValueError(
+                f"rank has to be in range [0, world_size): world_size: \
+                    {world_size}, rank: {rank}"
+            )
+
+        if world_size > 1 and seed is None:
+            raise ValueError(
+                "A seed shared by all processes is required when world_size > 1"
+            )
+
+        if num_threads < 1:
+            raise ValueError(
+                f"num_threads has to be at least 1: num_threads: {num_threads}"
+            )
+
+        if prefetch_depth < 1:
+            raise ValueError(
+                f"prefetch_depth has to be at least 1: prefetch_depth: \
+                    {prefetch_depth}"
+            )
+
         self.noded_rdf = RDF.AsRNode(rdataframe)
 
         if ROOT.Internal.RDF.GetDataSourceLabel(self.noded_rdf) != "TTreeDS":
@@ -136,6 +246,33 @@ class BaseGenerator:
             rdataframe, columns
         )
 
+        if ragged:
+            if any(c in self.vec_columns for c in self.target_columns):
+                raise ValueError(
+                    f"Target columns can not be ragged: target => \
+                        {self.target_columns}")
+
+            if len(self.vec_columns) == len(self.all_columns):
+                raise ValueError(
+                    "At least one column has to be a scalar when ragged is True")
+
+            self.ragged_columns = self.vec_columns
+
+        else:
+            for column in self.vec_columns:
+                if max_vec_sizes.get(column, 0) < 1:
+                    raise ValueError(
+                        f"max_vec_sizes has to give the size of the vector \
+                            based column {column}: max_vec_sizes => {max_vec_sizes}")
+
+            self.ragged_columns = []
+
+        # number of floats of each column in a row of a batch
+        self.column_sizes = [
+            0 if c in self.ragged_columns
+            else max_vec_sizes[c] if c in self.vec_columns
+            else 1 for c in self.all_columns]
+
         self.num_columns = len(self.all_columns)
         self.batch_size = batch_size
         self.num_epochs = num_epochs
@@ -179,9 +316,43 @@ class BaseGenerator:
             validation_split,            
             shuffle,            
             self.given_columns,
+            prefetch_depth,
+            cluster_aware,
+            num_threads,
+            -1 if seed is None else seed,
+            "" if cache_path is None else cache_path,
+            world_size,
+            rank,
+            "" if entry_index_path is None else entry_index_path,
+            ROOT.std.vector["std::size_t"](
+                [max_vec_sizes.get(c, 0) for c in self.given_columns]),
+            vec_padding,
+            ragged,
+            len(self.target_columns),
+            verbose,
         )
 
-        # atexit.register(self.DeActivate)
+        # stops the loading thread at exit, without keeping the generator alive until then
+        weakref.finalize(self, self.generator.DeActivate)
+
+    @property
+    def seed(self) -> int:
+        """The seed of the shuffling, also when it was drawn at random"""
+        return self.generator.GetSeed()
+
+    @property
+    def stage_timings(self) -> dict[str, float]:
+        """Cumulative time in seconds spent in each stage of the loading"""
+        return {str(p.first): p.second for p in self.generator.GetStageTimings()}
+
+    @property
+    def stage_counts(self) -> dict[str, int]:
+        """Number of chunks loaded and batches requested"""
+        return {str(p.first): p.second for p in self.generator.GetStageCounts()}
+
+    def ResetStageTimings(self):
+        """Reset the cumulative stage timings and counts"""
+        self.generator.ResetStageTimings()
 
     @property
     def is_active(self):
@@ -222,30 +393,69 @@ class BaseGenerator:
             batch (RTensor): Batch returned from the RBatchGenerator
 
         Returns:
-            torch.Tensor: converted batch
+            torch.Tensor: converted batch. The tensor shares the memory of
+            the batch, which is not reused by the generator as long as the
+            tensor, or any view of it, is alive.
+            If a target is given, the features and the targets are returned
+            as two contiguous tensors.
+            If ragged is True, a dict from the name of every vector based
+            column to its values and offsets is returned as well.
         """
         import torch
         import numpy as np
 
-        data = batch.GetData()
-        batch_size, num_columns = tuple(batch.GetShape())
+        batch_data = self.WrapTensor(batch.fTensor, np.float32, batch)
+        return_data = batch_data.reshape(tuple(batch.fTensor.GetShape()))
 
-        data.reshape((batch_size * num_columns,))
-
-        return_data = torch.as_tensor(np.asarray(data)).reshape(
-            batch_size, num_columns)
+        # A batch holds the features of its rows followed by their targets,
+        # so features and targets are both contiguous views into the batch
+        if self.target_given:
+            num_train_columns = sum(
+                self.column_sizes[i] for i in self.train_indices)
+            num_train_values = self.batch_size * num_train_columns
+            train_data = batch_data[:num_train_values].reshape(
+                (self.batch_size, num_train_columns))
+            target_data = batch_data[num_train_values:].reshape(
+                (self.batch_size, -1))
+
+            return_data = (train_data, target_data)
+
+        if not self.ragged_columns:
+            return return_data
+
+        # The values and offsets are views into the chunk of the batch as well
+        ragged_data = {
+            name: (
+                self.WrapTensor(
+                    self.generator.GetRaggedValues(i), np.float32, batch),
+                self.WrapTensor(
+                    self.generator.GetRaggedOffsets(i), np.int64, batch),
+            )
+            for i, name in enumerate(self.ragged_columns)
+        }
 
-        # Splice target column from the data if target is given
         if self.target_given:
-            train_data = return_data[:, self.train_indices]
-            target_data = return_data[:, self.target_indices]
+            return (*return_data, ragged_data)
+
+        return return_data, ragged_data
+
+    def WrapTensor(self, tensor: Any, dtype: Any, batch: Any) -> torch.Tensor:
+        """Wrap the memory of a RTensor of the given batch in a flat PyTorch
+        tensor through the buffer protocol, without copying. The tensor keeps
+        the batch alive, so that its chunk buffer is not reused before the
+        tensor is gone"""
+        import torch
+        import numpy as np
 
-            if len(self.target_indices) == 1:
-                return train_data, target_data.reshape(-1, 1)
+        size = tensor.GetSize()
+        if size == 0:
+            return torch.from_numpy(np.empty(0, dtype=dtype))
 
-            return train_data, target_data
+        data = tensor.GetData()
+        data.reshape((size,))
 
-        return return_data
+        return torch.as_tensor(
+            np.asarray(BatchBuffer(np.frombuffer(data, dtype=dtype), batch)))
 
     # Return a batch when available
     def GetTrainBatch(self) -> Any:
@@ -257,7 +467,7 @@ class BaseGenerator:
 
         batch = self.generator.GetTrainBatch()
 
-        if batch and batch.GetSize() > 0:
+        if batch.fTensor.GetSize() > 0:
             return batch
 
         return None
@@ -273,7 +483,7 @@ class BaseGenerator:
 
         batch = self.generator.GetValidationBatch()
 
-        if batch and batch.GetSize() > 0:
+        if batch.fTensor.GetSize() > 0:
             return batch
 
         return None
@@ -461,6 +671,18 @@ def CreatePyTorchGenerators(
     target: str | list[str] = list(),
     validation_split: float = 0,
     shuffle: bool = True,
+    prefetch_depth: int = 2,
+    cluster_aware: bool = False,
+    num_threads: int = 1,
+    seed: int | None = None,
+    cache_path: str | None = None,
+    world_size: int = 1,
+    rank: int = 0,
+    entry_index_path: str | None = None,
+    max_vec_sizes: dict[str, int] = dict(),
+    vec_padding: int = 0,
+    ragged: bool = False,
+    verbose: bool = True,
 ) -> Tuple[TrainRBatchGenerator, ValidationRBatchGenerator]:
     """
     Return two Tensorflow Datasets based on the given ROOT file and tree or RDataFrame
@@ -475,9 +697,13 @@ def CreatePyTorchGenerators(
             results in better randomization, but also higher memory usage.
         columns (list[str], optional):
             Columns to be returned. If not given, all columns are used.
-        max_vec_sizes (list[int], optional):
-            Size of each column that consists of vectors.
-            Required when using vector based columns
+        max_vec_sizes (dict[str, int], optional):
+            Size of each column that consists of vectors. Longer
+            vectors are truncated. Required when using vector based
+            columns, unless ragged is True.
+        vec_padding (int):
+            Value to pad vectors with if the vector is smaller
+            than the given max vector length. Defaults is 0
         target (str|list[str], optional):
             Column(s) used as target.
         weights (str, optional):
@@ -501,6 +727,60 @@ def CreatePyTorchGenerators(
             [4, 5, 6, 7] will be returned.
             If drop_remainder = False, then three batches [0, 1, 2, 3],
             [4, 5, 6, 7] and [8, 9] will be returned.
+        prefetch_depth (int):
+            The number of chunks the loading thread keeps loaded ahead of
+            the training loop. Defaults to 2.
+        cluster_aware (bool):
+            Prefetch only the TTree clusters touched by the ranges of a
+            chunk. Useful for small range sizes. Defaults to False.
+        num_threads (int):
+            The number of threads that read the ranges of a chunk in
+            parallel. Defaults to 1.
+        seed (int, optional):
+            Seed of the shuffling. Runs with the same seed and
+            configuration load the same batches. If not given, a
+            random seed is used.
+        cache_path (str, optional):
+            File in which the decoded columns are cached during the
+            first epoch. Later epochs and runs on the same files and
+            columns read from the cache instead of the dataset. Not
+            supported with ragged columns or filters without a name,
+            see entry_index_path. With world_size > 1 every
+            process caches its own block in cache_path.block<k>of<n>.
+        world_size (int):
+            The number of processes sharing the dataset, e.g. the DDP
+            world size. The dataset is split into world_size contiguous
+            blocks of the same size, which start at cluster boundaries
+            if the dataset has at least 4 clusters per block. Every
+            process plans its ranges and chunks within its own block, so
+            it only decodes the baskets of its block. The blocks are
+            assigned to the processes from the seed and the epoch, so
+            the processes switch blocks every epoch, unless cache_path
+            is given. Requires a seed shared by all processes, and at
+            least chunk_size entries per process.
+            Defaults to 1.
+        rank (int):
+            The rank of this process, from 0 to world_size - 1.
+            Defaults to 0.
+        entry_index_path (str, optional):
+            File in which the entries passing the filters of a
+            filtered RDataFrame are stored. Later runs on the same
+            files and filter names read it instead of evaluating the
+            filters. The filters are identified by their names only:
+            the index is not stored if a filter has no name, and has
+            to be removed when a cut changes under the same name. If
+            not given, the filters are evaluated once per run. The
+            filters are only skipped when loading the chunks if all
+            columns are branches of the tree; defined, friend or alias
+            columns are read with RDataFrame, which evaluates the
+            filters again every epoch.
+        ragged (bool):
+            Return the vector based columns in CSR layout instead of
+            padding them: for every batch, the values of the rows
+            and batch_size + 1 offsets into them. Defaults to False.
+        verbose (bool):
+            Print the distribution of the chunks and ranges when the
+            generator is created. Defaults to True.
 
     Returns:
         TrainRBatchGenerator or
@@ -522,6 +802,18 @@ def CreatePyTorchGenerators(
         target,
         validation_split,
         shuffle,
+        prefetch_depth,
+        cluster_aware,
+        num_threads,
+        seed,
+        cache_path,
+        world_size,
+        rank,
+        entry_index_path,
+        max_vec_sizes,
+        vec_padding,
+        ragged,
+        verbose,
     )
 
     train_generator = TrainRBatchGenerator(
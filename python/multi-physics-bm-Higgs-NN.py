@@ -35,7 +35,9 @@ for k in range(n_trainings):
     columns = rdf.GetColumnNames()
     target = ["Label"]    
     
-    gen_train, gen_validation =  RBG.CreatePyTorchGenerators(rdf, num_epochs, chunk_size, range_size, batch_size, columns, target, validation_split, shuffle)
+    # the k-th training uses the same seed for every chunk/range configuration
+    torch.manual_seed(k)
+    gen_train, gen_validation =  RBG.CreatePyTorchGenerators(rdf, num_epochs, chunk_size, range_size, batch_size, columns, target, validation_split, shuffle, seed=k)
 
     input_columns = gen_train.train_columns
     num_features = len(input_columns)